@@ -1,74 +1,220 @@
-/* Eliminate teeny little writes.  patch submitted by 
+/* Eliminate teeny little writes.  patch submitted by
    Rob Ross <rbross@parl.ces.clemson.edu> --Monty 19991008 */
 
+/* Each output gets its own writer: the ripping thread fills one of
+   OUTBUFS large buffers while a writer thread drains the others to
+   the file descriptor.  A disk or pipe that stalls for a moment then
+   costs nothing until every buffer is full, rather than stalling the
+   drive on every flush.  If the thread can't be started, full buffers
+   are simply written from the caller. */
+
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
 
-#define OUTBUFSZ 32*1024
+#define OUTBUFSZ (256*1024)
+#define OUTBUFS  4
 
 #include "utils.h"
 extern long blocking_write(int outf, char *buffer, long num);
 
+struct buffered_writer {
+	int   fd;
+	char *buf[OUTBUFS];
+	long  fill[OUTBUFS];	/* bytes in each buffer */
+	int   head;		/* buffer the caller is filling */
+	int   tail;		/* oldest buffer queued for writing */
+	int   queued;		/* buffers queued, tail onward */
+	int   error;		/* errno of the first failed write, or 0 */
+	int   quit;
 
-/* GLOBALS FOR BUFFERING CALLS */
-static int  bw_fd  = -1;
-static long bw_pos = 0;
-static char bw_outbuf[OUTBUFSZ];
+	int             threaded;
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;	/* a buffer was queued or written, or quit */
+};
 
+/* writer_drain_one() - writes out the oldest queued buffer.  Called
+ * with the lock held (or unthreaded); the lock is dropped for the
+ * write itself.
+ */
+static void writer_drain_one(buffered_writer *w)
+{
+	int i = w->tail;
+	int ret;
 
-/* buffering_write() - buffers data to a specified size before writing.
- *
- * Restrictions:
- * - MUST CALL BUFFERING_CLOSE() WHEN FINISHED!!!
- *
+	if (w->threaded) pthread_mutex_unlock(&w->lock);
+	ret = (w->error ? 0 : blocking_write(w->fd, w->buf[i], w->fill[i]));
+	if (w->threaded) pthread_mutex_lock(&w->lock);
+
+	/* after a failure the rest is dropped; the caller hears of it on
+	   its next write */
+	if (ret && !w->error) w->error = (errno ? errno : EIO);
+	w->tail = (i + 1) % OUTBUFS;
+	w->queued--;
+}
+
+static void *writer_thread(void *arg)
+{
+	buffered_writer *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->queued && !w->quit)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->queued) break;
+		writer_drain_one(w);
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return(NULL);
+}
+
+/* writer_queue() - hands the buffer being filled to the writer and
+ * waits, if need be, for the next one to come free.
  */
-long buffering_write(int fd, char *buffer, long num)
+static void writer_queue(buffered_writer *w)
 {
-	if (fd != bw_fd) {
-		/* clean up after buffering for some other file */
-		if (bw_fd >= 0 && bw_pos > 0) {
-			if (blocking_write(bw_fd, bw_outbuf, bw_pos)) {
-				perror("write (in buffering_write, flushing)");
-			}
-		}
-		bw_fd  = fd;
-		bw_pos = 0;
+	if (w->threaded) {
+		pthread_mutex_lock(&w->lock);
+		w->queued++;
+		pthread_cond_broadcast(&w->cond);
+		while (w->queued == OUTBUFS)
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	} else {
+		w->queued++;
+		writer_drain_one(w);
 	}
 
-	if (bw_pos + num > OUTBUFSZ) {
-		/* fill our buffer first, then write, then modify buffer and num */
-		memcpy(&bw_outbuf[bw_pos], buffer, OUTBUFSZ - bw_pos);
-		if (blocking_write(fd, bw_outbuf, OUTBUFSZ)) {
-			perror("write (in buffering_write, full buffer)");
-			return(-1);
+	w->head = (w->head + 1) % OUTBUFS;
+	w->fill[w->head] = 0;
+}
+
+static int writer_error(buffered_writer *w)
+{
+	int error;
+
+	if (w->threaded) pthread_mutex_lock(&w->lock);
+	error = w->error;
+	if (w->threaded) pthread_mutex_unlock(&w->lock);
+	return(error);
+}
+
+/* buffering_open() - starts buffering output to (fd), which becomes
+ * the writer's to close.  Returns NULL if out of memory.
+ */
+buffered_writer *buffering_open(int fd)
+{
+	buffered_writer *w = calloc(1, sizeof(*w));
+	int i;
+
+	if (!w) return(NULL);
+	w->fd = fd;
+	for (i = 0; i < OUTBUFS; i++) {
+		if (!(w->buf[i] = malloc(OUTBUFSZ))) {
+			while (i--) free(w->buf[i]);
+			free(w);
+			errno = ENOMEM;
+			return(NULL);
 		}
-		num -= (OUTBUFSZ - bw_pos);
-		buffer += (OUTBUFSZ - bw_pos);
-		bw_pos = 0;
 	}
-	/* save data */
-	if(buffer && num)
-	  memcpy(&bw_outbuf[bw_pos], buffer, num);
-	bw_pos += num;
 
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->threaded = 1;
+	if (pthread_create(&w->thread, NULL, writer_thread, w))
+		w->threaded = 0;
+	return(w);
+}
+
+/* buffering_store() - stores (num) bytes, byte swapping 16 bit
+ * samples on the way if (swap) is set, and queues each buffer as it
+ * fills.  Swapped writes must be whole samples.
+ */
+static long buffering_store(buffered_writer *w, char *buffer, long num,
+			    int swap)
+{
+	int error = writer_error(w);
+
+	if (error) {
+		errno = error;
+		return(-1);
+	}
+
+	while (num > 0) {
+		int i = w->head;
+		long n = OUTBUFSZ - w->fill[i];
+
+		if (n > num) n = num;
+		if (swap)
+			swap16_copy(w->buf[i] + w->fill[i], buffer, n);
+		else
+			memcpy(w->buf[i] + w->fill[i], buffer, n);
+		w->fill[i] += n;
+		buffer += n;
+		num -= n;
+
+		if (w->fill[i] == OUTBUFSZ)
+			writer_queue(w);
+	}
 	return(0);
 }
 
-/* buffering_close() - writes out remaining buffered data before closing
- * file.
+/* buffering_write() - buffers data to a specified size before writing.
  *
+ * Restrictions:
+ * - MUST CALL BUFFERING_CLOSE() WHEN FINISHED!!!
+ *
+ * Returns -1 with errno set once an earlier write has failed.
  */
-int buffering_close(int fd)
+long buffering_write(buffered_writer *w, char *buffer, long num)
 {
-	if (fd == bw_fd && bw_pos > 0) {
-		/* write out remaining data and clean up */
-		if (blocking_write(fd, bw_outbuf, bw_pos)) {
-			perror("write (in buffering_close)");
-		}
-		bw_fd  = -1;
-		bw_pos = 0;
+	return(buffering_store(w, buffer, num, 0));
+}
+
+/* buffering_write_swapped() - as buffering_write(), but byte swaps
+ * each 16 bit sample as it's copied into the buffer, leaving the
+ * caller's data alone.  (num) must be even.
+ */
+long buffering_write_swapped(buffered_writer *w, char *buffer, long num)
+{
+	return(buffering_store(w, buffer, num, 1));
+}
+
+/* buffering_close() - writes out remaining buffered data, stops the
+ * writer and closes the file.  Returns -1 with errno set if any
+ * write failed.
+ */
+int buffering_close(buffered_writer *w)
+{
+	int i, error, ret;
+
+	if (w->fill[w->head])
+		writer_queue(w);
+
+	if (w->threaded) {
+		pthread_mutex_lock(&w->lock);
+		w->quit = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+	}
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+
+	error = w->error;
+	ret = close(w->fd);
+	for (i = 0; i < OUTBUFS; i++) free(w->buf[i]);
+	free(w);
+
+	if (error) {
+		errno = error;
+		return(-1);
 	}
-	return(close(fd));
+	return(ret);
 }
@@ -29,17 +29,23 @@
    cache size and strategy used for reads. */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
 #include "interface/cdda_interface.h"
 #include "paranoia/cdda_paranoia.h"
 #include "version.h"
+#include "cachetest.h"
 
 /* not strictly just seeks, but also recapture and read resume when
    reading/readahead is suspended and idling */
 #define MIN_SEEK_MS 6
 
+/* the cache size search gives up at this many sectors; anything the
+   analysis reports (and so anything saved) is smaller */
+#define MAX_CACHE_SECTORS 15000
+
 #define reportC(...) {if(progress){fprintf(progress, __VA_ARGS__);}	\
     if(log){fprintf(log, __VA_ARGS__);}}
 #define printC(...) {if(progress){fprintf(progress, __VA_ARGS__);}}
@@ -119,7 +125,8 @@ static float retime_drive(cdrom_drive *d, FILE *progress, FILE *log, int lba, in
   return oldmean;
 }
 
-int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
+int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed,
+		  cache_profile *cp){
 
   /* Some assumptions about timing: 
 
@@ -153,7 +160,7 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
   int offset;
   int warn=0;
   int current=1000;
-  int hi=15000;
+  int hi=MAX_CACHE_SECTORS;
   int cachesize=0;
   int readahead=0;
   int rollbehind=0;
@@ -161,6 +168,11 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
   float mspersector=0;
   if(speed<=0)speed=-1;
 
+  cp->cachesize=-1;
+  cp->readahead=-1;
+  cp->rollbehind=-1;
+  cp->backseek=-1;
+
   reportC("\n=================== Checking drive cache/timing behavior ===================\n");
   d->error_retry=0;
 
@@ -376,8 +388,10 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
     return 1;
   }else if(cachesize){
     reportC("\tApproximate random access cache size: %d sector(s)               \n",cachesize);
+    cp->cachesize=cachesize;
   }else{
     reportC("\tDrive does not cache nonlinear access                            \n");
+    cp->cachesize=0;
     return 0;
   }
   
@@ -546,6 +560,7 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
     }
     readahead=lower;
   }
+  cp->readahead=readahead;
   logC("\n");
   printC("\r");
   if(readahead==0){
@@ -628,6 +643,7 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
   
   logC("\n");
   printC("\r");
+  cp->rollbehind=rollbehind;
   if(rollbehind==0){
     reportC("\tCache tail cursor tied to read cursor                      \n");
   }else{
@@ -834,9 +850,11 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
 	    reportC("\tWARNING: Read timing after backseek faster than expected!\n"
 		    "\t         It's possible/likely that this drive is not\n"
 		    "\t         flushing the readahead cache on backward seeks!\n\n");
+	    cp->backseek=0;
 	    warn=1;
 	  }else{
 	    reportC("\tBackseek flushes the cache as expected\n");
+	    cp->backseek=1;
 	  }
 	}
       }
@@ -849,4 +867,80 @@ int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed){
   return warn;
 }
 
+/* Cache results go in the drive profile file (see
+   cdda_profile_set()) as lines of their own:
+
+     cache size readahead rollbehind backseek model
+
+   The interface library passes over lines it doesn't recognize, and
+   we pass over its. */
+
+static int cache_profile_parse(char *line, cache_profile *cp, char **model){
+  int n=0;
+  char *e;
+
+  if(sscanf(line,"cache %d %d %d %d %n",&cp->cachesize,&cp->readahead,
+	    &cp->rollbehind,&cp->backseek,&n)<4 || !n)
+    return(-1);
 
+  /* -1 is a measurement that didn't get that far; nothing else the
+     analysis can't produce is taken from a hand edited line */
+  if(cp->cachesize<-1 || cp->cachesize>=MAX_CACHE_SECTORS ||
+     cp->readahead<-1 || cp->readahead>=MAX_CACHE_SECTORS ||
+     cp->rollbehind<-1 || cp->rollbehind>=MAX_CACHE_SECTORS ||
+     cp->backseek<-1 || cp->backseek>1)
+    return(-1);
+
+  *model=line+n;
+  if((e=strchr(*model,'\n')))*e=0;
+  return(0);
+}
+
+int cache_profile_load(cdrom_drive *d, const char *path, cache_profile *cp){
+  char line[256],*model;
+  FILE *f=fopen(path,"r");
+  int ret=-1;
+
+  if(!f)return(-1);
+  while(fgets(line,sizeof(line),f))
+    if(!cache_profile_parse(line,cp,&model) && !strcmp(model,d->drive_model)){
+      ret=0;
+      break;
+    }
+  fclose(f);
+  return(ret);
+}
+
+int cache_profile_save(cdrom_drive *d, const char *path, cache_profile *cp){
+  char line[256],copy[256],*model;
+  char *temp=malloc(strlen(path)+5);
+  cache_profile old;
+  FILE *in,*out;
+  int ret=0;
+
+  sprintf(temp,"%s.new",path);
+  if(!(out=fopen(temp,"w"))){
+    free(temp);
+    return(-1);
+  }
+
+  if((in=fopen(path,"r"))){
+    while(fgets(line,sizeof(line),in)){
+      strcpy(copy,line);
+      if(!cache_profile_parse(copy,&old,&model) && 
+	 !strcmp(model,d->drive_model))continue;
+      fputs(line,out);
+    }
+    fclose(in);
+  }
+
+  fprintf(out,"cache %d %d %d %d %s\n",cp->cachesize,cp->readahead,
+	  cp->rollbehind,cp->backseek,d->drive_model);
+
+  if(fclose(out) || rename(temp,path)){
+    unlink(temp);
+    ret=-1;
+  }
+  free(temp);
+  return(ret);
+}
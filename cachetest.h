@@ -0,0 +1,20 @@
+/******************************************************************
+ * CopyPolicy: GNU Public License 2 applies
+ * Copyright (C) 2008 Monty xiphmont@mit.edu
+ ******************************************************************/
+
+/* What analyze_cache() measured of the drive's cache; -1 wherever the
+   analysis didn't get that far. */
+typedef struct cache_profile{
+  int cachesize;   /* sectors cached for random access; 0 for none */
+  int readahead;   /* sectors the drive reads past the read cursor */
+  int rollbehind;  /* sectors the cache tail trails the read cursor */
+  int backseek;    /* 1 if a backward seek flushes the cache */
+} cache_profile;
+
+extern int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed,
+			 cache_profile *cp);
+extern int cache_profile_load(cdrom_drive *d, const char *path,
+			      cache_profile *cp);
+extern int cache_profile_save(cdrom_drive *d, const char *path,
+			      cache_profile *cp);
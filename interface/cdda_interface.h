@@ -125,6 +125,13 @@ extern char *cdda_version();
 extern int cdda_speed_set(cdrom_drive *d, int speed);
 extern void cdda_verbose_set(cdrom_drive *d,int err_action, int mes_action);
 extern char *cdda_messages(cdrom_drive *d);
+
+/* Keep what probing finds out about a drive (read command, density,
+   FUA, endianness, read size) in the file at (path), and on later
+   opens use it after one sanity read instead of probing again.  Call
+   before cdda_open(); NULL turns profiles off. */
+extern void cdda_profile_set(cdrom_drive *d, const char *path);
+
 extern char *cdda_errors(cdrom_drive *d);
 
 extern int cdda_close(cdrom_drive *d);
@@ -134,6 +141,18 @@ extern long cdda_read(cdrom_drive *d, void *buffer,
 extern long cdda_read_timed(cdrom_drive *d, void *buffer,
 			    long beginsector, long sectors, int *milliseconds);
 
+/* Queued reads: up to CDDA_QUEUE_DEPTH reads may be submitted before
+   the oldest is reaped.  Where the interface allows (SG_IO on a
+   generic SCSI device) they go to the drive immediately, so it keeps
+   streaming while the caller works; elsewhere each is performed when
+   it's reaped.  Reads are reaped in the order submitted; errors are
+   reported by cdda_read_reap() exactly as by cdda_read(). */
+#define CDDA_QUEUE_DEPTH 4
+extern int cdda_read_submit(cdrom_drive *d, void *buffer,
+			    long beginsector, long sectors);
+extern long cdda_read_reap(cdrom_drive *d, int *milliseconds);
+extern int cdda_read_queued(cdrom_drive *d);
+
 extern long cdda_track_firstsector(cdrom_drive *d,int track);
 extern long cdda_track_lastsector(cdrom_drive *d,int track);
 extern long cdda_tracks(cdrom_drive *d);
@@ -201,6 +220,8 @@ static char *strerror_tr[]={
 403: No audio tracks on disc
 404: No medium present
 405: Option not supported by drive
+406: Read queue full
+407: No read queued
 
 */
 #endif
@@ -8,12 +8,11 @@
  *
  ******************************************************************/
 
-#include <math.h>
 #include "low_interface.h"
 #include "utils.h"
-#include "smallft.h"
 
 #include <linux/hdreg.h>
+#include <pthread.h>
 
 /* Test for presence of a cdrom by pinging with the 'CDROMVOLREAD' ioctl() */
 /* Also test using CDROM_GET_CAPABILITY (if available) as some newer DVDROMs will
@@ -50,97 +49,198 @@ char *atapi_drive_info(int fd){
   return(ret);
 }
 
+/* Audio changes little from one sample to the next; read with the
+   wrong byte order it turns to noise.  So, for each way of reading
+   the data, sum the differences between successive samples of each
+   channel; the order with less of this 'difference energy' is the
+   right one.
+
+   The SSE2 and AVX2 kernels take 8 or 16 samples a step.  The
+   absolute difference is max-min, which fits an unsigned 16 bit lane
+   exactly; lanes are widened into 32 bit sums that are folded into
+   the 64 bit totals every ENERGY_BLOCK steps, before they can wrap.
+   The plain C version defines the result and is used on everything
+   else. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__) || __GNUC__>4 || (__GNUC__==4 && __GNUC_MINOR__>=9)
+#define ENERGY_X86
+#include <immintrin.h>
+#endif
+#endif
+
+/* vector steps per fold; each adds at most 2*65535 to a 32 bit lane */
+#define ENERGY_BLOCK 16384
+
+static void energy_span(int16_t *buff,long j,long words,
+			int64_t *native,int64_t *swapped){
+  for(;j<words;j++){
+    int32_t x=buff[j],y=buff[j-2];
+    int32_t xs=(int16_t)(((u_int16_t)x<<8)|((u_int16_t)x>>8));
+    int32_t ys=(int16_t)(((u_int16_t)y<<8)|((u_int16_t)y>>8));
+    *native+=abs(x-y);
+    *swapped+=abs(xs-ys);
+  }
+}
+
+static void energy_c(int16_t *buff,long words,
+		     int64_t *native,int64_t *swapped){
+  energy_span(buff,2,words,native,swapped);
+}
+
+#ifdef ENERGY_X86
+
+__attribute__((target("sse2")))
+static int64_t energy_fold_sse2(__m128i acc){
+  u_int32_t l[4];
+  _mm_storeu_si128((__m128i *)l,acc);
+  return((int64_t)l[0]+l[1]+l[2]+l[3]);
+}
+
+__attribute__((target("sse2")))
+static void energy_sse2(int16_t *buff,long words,
+			int64_t *native,int64_t *swapped){
+  __m128i zero=_mm_setzero_si128();
+  long j=2;
+
+  while(j+8<=words){
+    __m128i an=zero,as=zero;
+    long end=(words-j>8L*ENERGY_BLOCK?j+8L*ENERGY_BLOCK:words);
+    for(;j+8<=end;j+=8){
+      __m128i x=_mm_loadu_si128((__m128i *)(buff+j));
+      __m128i y=_mm_loadu_si128((__m128i *)(buff+j-2));
+      __m128i xs=_mm_or_si128(_mm_slli_epi16(x,8),_mm_srli_epi16(x,8));
+      __m128i ys=_mm_or_si128(_mm_slli_epi16(y,8),_mm_srli_epi16(y,8));
+      __m128i d=_mm_sub_epi16(_mm_max_epi16(x,y),_mm_min_epi16(x,y));
+      __m128i ds=_mm_sub_epi16(_mm_max_epi16(xs,ys),_mm_min_epi16(xs,ys));
+      an=_mm_add_epi32(an,_mm_unpacklo_epi16(d,zero));
+      an=_mm_add_epi32(an,_mm_unpackhi_epi16(d,zero));
+      as=_mm_add_epi32(as,_mm_unpacklo_epi16(ds,zero));
+      as=_mm_add_epi32(as,_mm_unpackhi_epi16(ds,zero));
+    }
+    *native+=energy_fold_sse2(an);
+    *swapped+=energy_fold_sse2(as);
+  }
+  energy_span(buff,j,words,native,swapped);
+}
+
+__attribute__((target("avx2")))
+static int64_t energy_fold_avx2(__m256i acc){
+  u_int32_t l[8];
+  _mm256_storeu_si256((__m256i *)l,acc);
+  return((int64_t)l[0]+l[1]+l[2]+l[3]+l[4]+l[5]+l[6]+l[7]);
+}
+
+__attribute__((target("avx2")))
+static void energy_avx2(int16_t *buff,long words,
+			int64_t *native,int64_t *swapped){
+  __m256i zero=_mm256_setzero_si256();
+  long j=2;
+
+  while(j+16<=words){
+    __m256i an=zero,as=zero;
+    long end=(words-j>16L*ENERGY_BLOCK?j+16L*ENERGY_BLOCK:words);
+    for(;j+16<=end;j+=16){
+      __m256i x=_mm256_loadu_si256((__m256i *)(buff+j));
+      __m256i y=_mm256_loadu_si256((__m256i *)(buff+j-2));
+      __m256i xs=_mm256_or_si256(_mm256_slli_epi16(x,8),_mm256_srli_epi16(x,8));
+      __m256i ys=_mm256_or_si256(_mm256_slli_epi16(y,8),_mm256_srli_epi16(y,8));
+      __m256i d=_mm256_sub_epi16(_mm256_max_epi16(x,y),_mm256_min_epi16(x,y));
+      __m256i ds=_mm256_sub_epi16(_mm256_max_epi16(xs,ys),
+				  _mm256_min_epi16(xs,ys));
+      an=_mm256_add_epi32(an,_mm256_unpacklo_epi16(d,zero));
+      an=_mm256_add_epi32(an,_mm256_unpackhi_epi16(d,zero));
+      as=_mm256_add_epi32(as,_mm256_unpacklo_epi16(ds,zero));
+      as=_mm256_add_epi32(as,_mm256_unpackhi_epi16(ds,zero));
+    }
+    *native+=energy_fold_avx2(an);
+    *swapped+=energy_fold_avx2(as);
+  }
+  energy_span(buff,j,words,native,swapped);
+}
+
+#endif
+
+/* resolved once; drives may be probed from more than one thread */
+static void (*energy)(int16_t *buff,long words,
+		      int64_t *native,int64_t *swapped)=energy_c;
+static pthread_once_t energy_once=PTHREAD_ONCE_INIT;
+
+static void energy_resolve(void){
+#ifdef ENERGY_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2"))energy=energy_sse2;
+  if(__builtin_cpu_supports("avx2"))energy=energy_avx2;
+#endif
+}
+
+static void difference_energy(int16_t *buff,long words,
+			      double *lsb_energy,double *msb_energy){
+  int64_t native=0,swapped=0;
+
+  pthread_once(&energy_once,energy_resolve);
+  energy(buff,words,&native,&swapped);
+
+  if(bigendianp()){
+    *lsb_energy=swapped;
+    *msb_energy=native;
+  }else{
+    *lsb_energy=native;
+    *msb_energy=swapped;
+  }
+}
+
+/* votes one way, with none the other, that settle the question */
+#define ENDIAN_CONFIDENCE 16.
+
 int data_bigendianp(cdrom_drive *d){
   float lsb_votes=0;
   float msb_votes=0;
-  int i,checked;
+  int i;
   int endiancache=d->bigendianp;
-  float *a=calloc(1024,sizeof(float));
-  float *b=calloc(1024,sizeof(float));
   long readsectors=5;
   int16_t *buff=malloc(readsectors*CD_FRAMESIZE_RAW);
 
-  /* look at the starts of the audio tracks */
-  /* if real silence, tool in until some static is found */
+  /* Look at the middle of each audio track, where a long silent intro
+     won't be in the way; a track that's silent there too doesn't
+     vote.  Each vote is weighted by how lopsided the difference
+     energies are, and we stop once one way is clearly ahead. */
 
   /* Force no swap for now */
   d->bigendianp=-1;
   
   cdmessage(d,"\nAttempting to determine drive endianness from data...");
   d->enable_cdda(d,1);
-  for(i=0,checked=0;i<d->tracks;i++){
-    float lsb_energy=0;
-    float msb_energy=0;
+  for(i=0;i<d->tracks;i++){
     if(cdda_track_audiop(d,i+1)==1){
       long firstsector=cdda_track_firstsector(d,i+1);
       long lastsector=cdda_track_lastsector(d,i+1);
-      int zeroflag=-1;
-      long beginsec=0;
-      
-      /* find a block with nonzero data */
-      
-      while(firstsector+readsectors<=lastsector){
-	int j;
-	
-	if(d->read_audio(d,buff,firstsector,readsectors)>0){
-	  
-	  /* Avoid scanning through jitter at the edges */
-	  for(beginsec=0;beginsec<readsectors;beginsec++){
-	    int offset=beginsec*CD_FRAMESIZE_RAW/2;
-	    /* Search *half* */
-	    for(j=460;j<128+460;j++)
-	      if(buff[offset+j]!=0){
-		zeroflag=0;
-		break;
-	      }
-	    if(!zeroflag)break;
-	  }
-	  if(!zeroflag)break;
-	  firstsector+=readsectors;
-	}else{
-	  d->enable_cdda(d,0);
-	  free(a);
-	  free(b);
-	  free(buff);
-	  return(-1);
-	}
-      }
+      long sector=(firstsector+lastsector-readsectors)>>1;
+      double lsb_energy,msb_energy;
 
-      beginsec*=CD_FRAMESIZE_RAW/2;
-      
-      /* un-interleave for an fft */
-      if(!zeroflag){
-	int j;
-	
-	for(j=0;j<128;j++)a[j]=le16_to_cpu(buff[j*2+beginsec+460]);
-	for(j=0;j<128;j++)b[j]=le16_to_cpu(buff[j*2+beginsec+461]);
-	fft_forward(128,a,NULL,NULL);
-	fft_forward(128,b,NULL,NULL);
-	for(j=0;j<128;j++)lsb_energy+=fabs(a[j])+fabs(b[j]);
-	
-	for(j=0;j<128;j++)a[j]=be16_to_cpu(buff[j*2+beginsec+460]);
-	for(j=0;j<128;j++)b[j]=be16_to_cpu(buff[j*2+beginsec+461]);
-	fft_forward(128,a,NULL,NULL);
-	fft_forward(128,b,NULL,NULL);
-	for(j=0;j<128;j++)msb_energy+=fabs(a[j])+fabs(b[j]);
+      if(sector<firstsector)sector=firstsector;
+      if(sector+readsectors>lastsector+1)continue;
+
+      if(d->read_audio(d,buff,sector,readsectors)<=0){
+	d->enable_cdda(d,0);
+	free(buff);
+	return(-1);
       }
+
+      difference_energy(buff,readsectors*CD_FRAMESIZE_RAW/2,
+			&lsb_energy,&msb_energy);
+      if(lsb_energy<msb_energy)
+	lsb_votes+=(lsb_energy?msb_energy/lsb_energy:ENDIAN_CONFIDENCE);
+      else if(lsb_energy>msb_energy)
+	msb_votes+=(msb_energy?lsb_energy/msb_energy:ENDIAN_CONFIDENCE);
     }
-    if(lsb_energy<msb_energy){
-      lsb_votes+=msb_energy/lsb_energy;
-      checked++;
-    }else
-      if(lsb_energy>msb_energy){
-	msb_votes+=lsb_energy/msb_energy;
-	checked++;
-      }
 
-    if(checked==5 && (lsb_votes==0 || msb_votes==0))break;
+    if((lsb_votes>=ENDIAN_CONFIDENCE && msb_votes==0) ||
+       (msb_votes>=ENDIAN_CONFIDENCE && lsb_votes==0))break;
     cdmessage(d,".");
   }
 
   free(buff);
-  free(a);
-  free(b);
   d->bigendianp=endiancache;
   d->enable_cdda(d,0);
 
@@ -40,7 +40,11 @@ int cdda_close(cdrom_drive *d){
     if(d->cdda_fd!=-1)close(d->cdda_fd);
     if(d->ioctl_fd!=-1 && d->ioctl_fd!=d->cdda_fd)close(d->ioctl_fd);
     if(d->private_data){
+      int i;
       if(d->private_data->sg_hd)free(d->private_data->sg_hd);
+      if(d->private_data->profile)free(d->private_data->profile);
+      for(i=0;i<CDDA_QUEUE_DEPTH;i++)
+	if(d->private_data->queue[i].dma)free(d->private_data->queue[i].dma);
       free(d->private_data);
     }
 
@@ -91,6 +95,7 @@ int cdda_open(cdrom_drive *d){
   }
 
   if(d->bigendianp==-1)d->bigendianp=data_bigendianp(d);
+  scsi_save_profile(d);
 
   if((ret=d->enable_cdda(d,1)))
     return(ret);
@@ -107,25 +112,23 @@ int cdda_speed_set(cdrom_drive *d, int speed)
   return -405;
 }
 
+static void byteswap_read(cdrom_drive *d, void *buffer, long sectors){
+  if(sectors>0){
+    /* byteswap? */
+    if(d->bigendianp==-1) /* not determined yet */
+      d->bigendianp=data_bigendianp(d);
+    
+    if(buffer && d->bigendianp!=bigendianp())
+      swap16_copy(buffer,buffer,sectors*CD_FRAMESIZE_RAW);
+  }	
+}
+
 long cdda_read_timed(cdrom_drive *d, void *buffer, long beginsector, long sectors, int *ms){
   if(ms)*ms= -1;
   if(d->opened){
     if(sectors>0){
       sectors=d->read_audio(d,buffer,beginsector,sectors);
-
-      if(sectors>0){
-	/* byteswap? */
-	if(d->bigendianp==-1) /* not determined yet */
-	  d->bigendianp=data_bigendianp(d);
-	
-	if(buffer && d->bigendianp!=bigendianp()){
-	  int i;
-	  u_int16_t *p=(u_int16_t *)buffer;
-	  long els=sectors*CD_FRAMESIZE_RAW/2;
-	  
-	  for(i=0;i<els;i++)p[i]=swap16(p[i]);
-	}
-      }	
+      byteswap_read(d,buffer,sectors);
     }
     if(ms)*ms=d->private_data->last_milliseconds;
     return(sectors);
@@ -135,10 +138,69 @@ long cdda_read_timed(cdrom_drive *d, void *buffer, long beginsector, long sector
   return(-400);
 }
 
+int cdda_read_submit(cdrom_drive *d, void *buffer, long beginsector, long sectors){
+  cdda_private_data_t *pd=d->private_data;
+  cdda_request *r;
+
+  if(pd->queued>=CDDA_QUEUE_DEPTH){
+    cderror(d,"406: Read queue full\n");
+    return(-406);
+  }
+
+  r=pd->queue+(pd->queue_head+pd->queued)%CDDA_QUEUE_DEPTH;
+  pd->queued++;
+  r->buffer=buffer;
+  r->begin=beginsector;
+  r->sectors=sectors;
+  r->done=0;
+
+  /* if the drive won't take it now, it's read when reaped */
+  r->issued=(d->opened && sectors>0 && pd->submit && !pd->submit(d,r));
+  return(0);
+}
+
+long cdda_read_reap(cdrom_drive *d, int *ms){
+  cdda_private_data_t *pd=d->private_data;
+  cdda_request *r;
+  long sectors=-1;
+
+  if(ms)*ms= -1;
+  if(!pd->queued){
+    cderror(d,"407: No read queued\n");
+    return(-407);
+  }
+
+  r=pd->queue+pd->queue_head;
+  pd->queue_head=(pd->queue_head+1)%CDDA_QUEUE_DEPTH;
+  pd->queued--;
+
+  if(r->issued){
+    sectors=pd->reap(d,r);
+    if(sectors>0){
+      byteswap_read(d,r->buffer,sectors);
+      if(ms)*ms=pd->last_milliseconds;
+      return(sectors);
+    }
+  }
+
+  /* not issued, or it failed; the synchronous path has all the retry
+     and backoff logic */
+  return(cdda_read_timed(d,r->buffer,r->begin,r->sectors,ms));
+}
+
+int cdda_read_queued(cdrom_drive *d){
+  return(d->private_data->queued);
+}
+
 long cdda_read(cdrom_drive *d, void *buffer, long beginsector, long sectors){
   return cdda_read_timed(d,buffer,beginsector,sectors,NULL);
 }
 
+void cdda_profile_set(cdrom_drive *d, const char *path){
+  if(d->private_data->profile)free(d->private_data->profile);
+  d->private_data->profile=(path?copystring(path):NULL);
+}
+
 void cdda_verbose_set(cdrom_drive *d,int err_action, int mes_action){
   d->messagedest=mes_action;
   d->errordest=err_action;
@@ -97,21 +97,58 @@ typedef struct sg_io_hdr
 
 #endif
 
+/* One read queued with cdda_read_submit().  Interfaces that can keep
+   several commands in flight issue it at once; otherwise it's simply
+   read when it's reaped. */
+typedef struct cdda_request{
+  void *buffer;             /* caller's destination (may be NULL) */
+  long begin;
+  long sectors;
+  int issued;               /* handed to the drive by submit() */
+  int done;                 /* reply collected */
+
+  /* SG_IO specifics */
+  int pack_id;
+  unsigned char *dma;       /* d->nsectors worth; freed by cdda_close() */
+  int direct;               /* reading straight into buffer, not dma */
+  unsigned char bytefill;
+  int bytecheck;
+  unsigned char sense[SG_MAX_SENSE];
+  struct sg_io_hdr hdr;
+} cdda_request;
+
 struct cdda_private_data {
   struct sg_header *sg_hd;
   unsigned char *sg_buffer; /* points into sg_hd */
+  unsigned char *dxfer;     /* caller's buffer SG_IO reads land in, or NULL */
+  int resid;                /* bytes the last SG_IO read came up short */
   clockid_t clock;
   int last_milliseconds;
+
+  /* cdda_read_submit() queue, oldest at queue_head */
+  cdda_request queue[CDDA_QUEUE_DEPTH];
+  int queue_head;
+  int queued;
+  int  (*submit)(cdrom_drive *d, cdda_request *r); /* NULL: no async */
+  long (*reap)  (cdrom_drive *d, cdda_request *r);
+  cdda_request *capture;    /* set while submit() builds a command */
+  int pack_id;
+  int abandoned;            /* gave up on a reply bound for a caller's buffer */
+
+  char *profile;            /* drive profile file, or NULL */
+  int profiled;             /* settings came from the profile */
 };
 
 #define MAX_RETRIES 8
 #define MAX_BIG_BUFF_SIZE 65536
 #define MIN_BIG_BUFF_SIZE 4096
 #define SG_OFF sizeof(struct sg_header)
+#define SG_DXFER_ALIGN 512 /* caller buffers this aligned are read into directly */
 
 extern int  cooked_init_drive (cdrom_drive *d);
 extern unsigned char *scsi_inquiry (cdrom_drive *d);
 extern int  scsi_init_drive (cdrom_drive *d);
+extern void scsi_save_profile (cdrom_drive *d);
 #ifdef CDDA_TEST
 extern int  test_init_drive (cdrom_drive *d);
 #endif
@@ -12,6 +12,7 @@
 #include "common_interface.h"
 #include "utils.h"
 #include <time.h>
+#include <poll.h>
 static int timed_ioctl(cdrom_drive *d, int fd, int command, void *arg){
   struct timespec tv1;
   struct timespec tv2;
@@ -74,6 +75,8 @@ static void tweak_SG_buffer(cdrom_drive *d) {
    * still fail the wrong way.  This needs some kernel-land investigation.
    */
   /* Bumping to 64kB  transfer max --Monty */
+  /* ...as a starting point; on SG_IO, probe_transfer_size() walks it
+     back up toward the queue limit once it can read audio to check. */
 
   if (!getenv("CDDA_IGNORE_BUFSIZE_LIMIT")) {
     cur=(cur>1024*64?1024*64:cur);
@@ -333,6 +336,83 @@ static int sg2_handle_scsi_cmd(cdrom_drive *d,
   return(0);
 }
 
+/* Queued SG_IO: the sg v3 write()/read() interface takes the same
+   sg_io_hdr as ioctl(SG_IO), but write() returns as soon as the
+   command is queued and read() collects a finished one.  Each queued
+   read gets its own header, sense and DMA buffer; usr_ptr and pack_id
+   lead a reply back to its request.  Only the generic (sg) character
+   device offers this; SG_IO on the block device is synchronous.
+
+   A read whose destination is SG_DXFER_ALIGN aligned (paranoia's
+   c_block buffers are) transfers straight into it instead of the DMA
+   buffer.  Those commands go without SG_FLAG_DIRECT_IO, so the sg
+   driver copies the data out only when the reply is read.  If one is
+   abandoned, its reply could still turn up and be read into a buffer
+   the caller has since reused; so no reply is read on the drive
+   again, and queueing stops (see sgio_reap()). */
+
+/* While private_data->capture is set, sgio_handle_scsi_cmd() queues
+   the command it's handed on that request instead of running it. */
+static int sgio_queue_scsi_cmd(cdrom_drive *d,
+			       cdda_request *r,
+			       unsigned char *cmd,
+			       unsigned int cmd_len, 
+			       unsigned int out_size,       
+			       unsigned char bytefill,
+			       int bytecheck){
+  struct sg_io_hdr *hdr=&r->hdr;
+  unsigned char *dest;
+
+  if(out_size>d->nsectors*CD_FRAMESIZE_RAW){
+    errno=ENOMEM;
+    return(TR_EWRITE);
+  }
+
+  r->direct=(r->buffer && out_size &&
+	     !((unsigned long)r->buffer&(SG_DXFER_ALIGN-1)));
+  if(r->direct)
+    dest=r->buffer;
+  else{
+    if(!r->dma)r->dma=malloc(d->nsectors*CD_FRAMESIZE_RAW);
+    if(!r->dma){
+      errno=ENOMEM;
+      return(TR_EWRITE);
+    }
+    dest=r->dma;
+  }
+
+  memset(hdr,0,sizeof(*hdr));
+  memset(r->sense,0,sizeof(r->sense));
+  r->pack_id=++d->private_data->pack_id;
+  r->bytefill=bytefill;
+  r->bytecheck=bytecheck;
+
+  hdr->cmdp = cmd;
+  hdr->cmd_len = cmd_len;
+  hdr->sbp = r->sense;
+  hdr->mx_sb_len = SG_MAX_SENSE;
+  hdr->timeout = 50000;
+  hdr->interface_id = 'S';
+  hdr->dxferp = dest;
+  hdr->dxfer_len = out_size;
+  hdr->flags = (r->direct ? 0 : SG_FLAG_DIRECT_IO);
+  hdr->pack_id = r->pack_id;
+  hdr->usr_ptr = r;
+
+  hdr->dxfer_direction = out_size ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+
+  /* scary buffer fill hack; see sgio_handle_scsi_cmd() */
+  if(bytecheck && d->interface == SGIO_SCSI_BUGGY1 && out_size)
+    memset(dest,bytefill,out_size); 
+
+  errno = 0;
+  if(write(d->cdda_fd,hdr,sizeof(*hdr))!=sizeof(*hdr)){
+    if(errno==0)errno=EIO;
+    return(TR_EWRITE);
+  }
+  return(0);
+}
+
 static int sgio_handle_scsi_cmd(cdrom_drive *d,
 				unsigned char *cmd,
 				unsigned int cmd_len, 
@@ -342,12 +422,27 @@ static int sgio_handle_scsi_cmd(cdrom_drive *d,
 				int bytecheck,
 				unsigned char *sense){
 
-  int status = 0;
+  int status = 0,fill;
   struct sg_io_hdr hdr;
+  cdda_request *r=d->private_data->capture;
+  unsigned char *buffer=d->private_data->sg_buffer;
+
+  if(r)return sgio_queue_scsi_cmd(d,r,cmd,cmd_len,out_size,bytefill,bytecheck);
+
+  /* a pure read can go straight to the caller's buffer; see
+     scsi_read_map() */
+  if(d->private_data->dxfer && !in_size)
+    buffer=d->private_data->dxfer;
+
+  /* SG_IO reports a short transfer in resid and a lost one in
+     host_status/driver_status, so the fill hack is kept only for the
+     SGIO_SCSI_BUGGY1 workaround, which we trust less. */
+  fill=(bytecheck && d->interface == SGIO_SCSI_BUGGY1);
+  d->private_data->resid=0;
 
   memset(&hdr,0,sizeof(hdr));
   memset(sense,0,sizeof(sense));
-  memcpy(d->private_data->sg_buffer,cmd+cmd_len,in_size);
+  memcpy(buffer,cmd+cmd_len,in_size);
 
   hdr.cmdp = cmd;
   hdr.cmd_len = cmd_len;
@@ -355,11 +450,11 @@ static int sgio_handle_scsi_cmd(cdrom_drive *d,
   hdr.mx_sb_len = SG_MAX_SENSE;
   hdr.timeout = 50000;
   hdr.interface_id = 'S';
-  hdr.dxferp =  d->private_data->sg_buffer;
+  hdr.dxferp =  buffer;
   hdr.flags = SG_FLAG_DIRECT_IO;  /* direct IO if we can get it */
 
   /* scary buffer fill hack */
-  if(bytecheck && out_size>in_size)
+  if(fill && out_size>in_size)
     memset(hdr.dxferp+in_size,bytefill,out_size-in_size); 
 
   if (in_size) {
@@ -377,11 +472,7 @@ static int sgio_handle_scsi_cmd(cdrom_drive *d,
 
   if (!in_size | out_size) {
     hdr.dxfer_len = out_size;
-
-    if(bytecheck && d->interface != SGIO_SCSI_BUGGY1)
-      hdr.dxfer_direction = out_size ? SG_DXFER_TO_FROM_DEV : SG_DXFER_NONE;
-    else
-      hdr.dxfer_direction = out_size ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+    hdr.dxfer_direction = out_size ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
 
     errno = 0;
     status = timed_ioctl(d,d->ioctl_fd, SG_IO, &hdr);
@@ -390,6 +481,18 @@ static int sgio_handle_scsi_cmd(cdrom_drive *d,
       if(status) return status;
     }
     if (status < 0) return status;
+
+    /* driver_status carries DRIVER_SENSE along with a CHECK
+       CONDITION that check_sbp_error() let through */
+    if (hdr.host_status || (!hdr.status && hdr.driver_status)){
+      errno=EIO;
+      return(TR_EREAD);
+    }
+    d->private_data->resid=hdr.resid;
+    if (bytecheck && !fill && hdr.resid>=(int)out_size){
+      errno=EINVAL;
+      return(TR_ILLEGAL);
+    }
   }
 
   /* Failed/Partial DMA transfers occasionally get through.  Why?  No clue,
@@ -397,10 +500,10 @@ static int sgio_handle_scsi_cmd(cdrom_drive *d,
      fewer bytes than we request with no indication anything went
      wrong. */
   
-  if(bytecheck && in_size<out_size){
+  if(fill && in_size<out_size){
     long i,flag=0;
     for(i=in_size;i<out_size;i++)
-      if(d->private_data->sg_buffer[i]!=bytefill){
+      if(buffer[i]!=bytefill){
 	flag=1;
 	break;
       }
@@ -1057,22 +1160,51 @@ static int i_read_msf3 (cdrom_drive *d, void *p, long begin, long sectors, unsig
 }
 
 
+/* How many of the (sectors) just read into (buffer) really arrived.
+   SG_IO says so in resid; the sg2 interface and SGIO_SCSI_BUGGY1
+   leave us to find where the fill pattern starts. */
+static long sectors_returned(cdrom_drive *d, unsigned char *buffer,
+			     long sectors, long resid){
+  long i;
+
+  if(d->interface == SGIO_SCSI)
+    return((sectors*CD_FRAMESIZE_RAW-resid)/CD_FRAMESIZE_RAW);
+
+  for(i=sectors*CD_FRAMESIZE_RAW;i>1;i-=2)
+    if(buffer[i-1]!='\177' || buffer[i-2]!='\177')
+      break;
+  return(i/CD_FRAMESIZE_RAW);
+}
+
 static long scsi_read_map (cdrom_drive *d, void *p, long begin, long sectors,
 			   int (*map)(cdrom_drive *, void *, long, long, 
 				      unsigned char *)){
   unsigned char sense[SG_MAX_SENSE];
   int retry_count,err;
   char *buffer=(char *)p;
+  int direct=0;
 
   /* read d->nsectors at a time, max. */
   sectors=(sectors>d->nsectors?d->nsectors:sectors);
   sectors=(sectors<1?1:sectors);
 
+  /* SG_IO can transfer straight into the caller's buffer, sparing the
+     copy out of sg_buffer, as long as the buffer is aligned well
+     enough for the kernel to map it.  The old sg2 interface always
+     goes through sg_buffer. */
+  if(buffer && !((unsigned long)buffer&(SG_DXFER_ALIGN-1)) &&
+     (d->interface == SGIO_SCSI || d->interface == SGIO_SCSI_BUGGY1))
+    direct=1;
+
   retry_count=0;
   
   while(1) {
 
-    if((err=map(d,(p?buffer:NULL),begin,sectors,sense))){
+    if(direct)d->private_data->dxfer=(unsigned char *)buffer;
+    err=map(d,(p && !direct?buffer:NULL),begin,sectors,sense);
+    d->private_data->dxfer=NULL;
+
+    if(err){
       if(d->report_all){
 	char b[256];
 
@@ -1156,12 +1288,8 @@ static long scsi_read_map (cdrom_drive *d, void *p, long begin, long sectors,
       /* Did we get all the bytes we think we did, or did the kernel
          suck? */
       if(buffer){
-	long i;
-	for(i=sectors*CD_FRAMESIZE_RAW;i>1;i-=2)
-	  if(buffer[i-1]!='\177' || buffer[i-2]!='\177')
-	    break;
-
-	i/=CD_FRAMESIZE_RAW;
+	long i=sectors_returned(d,(unsigned char *)buffer,sectors,
+				d->private_data->resid);
 	if(i!=sectors){
 	  if(d->report_all){
 	    char b[256];
@@ -1268,23 +1396,232 @@ long scsi_read_msf3 (cdrom_drive *d, void *p, long begin,
 }
 
 
+/* which command builder each read_audio entry point uses, so that
+   queued reads issue the same command; the name identifies the
+   entry in drive profiles */
+static struct {
+  char *name;
+  long (*read_audio)(cdrom_drive *, void *, long, long);
+  int  (*map)(cdrom_drive *, void *, long, long, unsigned char *);
+} read_maps[]={
+  {"28",   scsi_read_28,   i_read_28},
+  {"A8",   scsi_read_A8,   i_read_A8},
+  {"D4_10",scsi_read_D4_10,i_read_D4_10},
+  {"D4_12",scsi_read_D4_12,i_read_D4_12},
+  {"D5",   scsi_read_D5,   i_read_D5},
+  {"D8",   scsi_read_D8,   i_read_D8},
+  {"mmc",  scsi_read_mmc,  i_read_mmc},
+  {"mmc2", scsi_read_mmc2, i_read_mmc2},
+  {"mmc3", scsi_read_mmc3, i_read_mmc3},
+  {"mmcB", scsi_read_mmcB, i_read_mmcB},
+  {"mmc2B",scsi_read_mmc2B,i_read_mmc2B},
+  {"mmc3B",scsi_read_mmc3B,i_read_mmc3B},
+  {"msf",  scsi_read_msf,  i_read_msf},
+  {"msf2", scsi_read_msf2, i_read_msf2},
+  {"msf3", scsi_read_msf3, i_read_msf3},
+  {NULL,NULL,NULL}
+};
+
+static int sgio_submit(cdrom_drive *d, cdda_request *r){
+  int i,ret;
+
+  for(i=0;read_maps[i].read_audio;i++)
+    if(read_maps[i].read_audio==d->read_audio)break;
+  if(!read_maps[i].map || d->private_data->abandoned)return(-1);
+
+  /* as scsi_read_map() would */
+  if(r->sectors>d->nsectors)r->sectors=d->nsectors;
+
+  d->private_data->capture=r;
+  ret=read_maps[i].map(d,NULL,r->begin,r->sectors,r->sense);
+  d->private_data->capture=NULL;
+  return(ret);
+}
+
+/* Waits for (r)'s reply, collecting any other replies that arrive
+   first, and copies its data out.  Returns the sectors read, or -1
+   to have the caller fall back to a synchronous read. */
+static long sgio_reap(cdrom_drive *d, cdda_request *r){
+  struct timespec tv1,tv2;
+  int tret1,tret2,ret;
+  long i;
+
+  if(d->private_data->abandoned)return(-1);
+
+  tret1=clock_gettime(d->private_data->clock,&tv1);
+  while(!r->done){
+    struct sg_io_hdr hdr;
+    struct pollfd pfd;
+    cdda_request *q;
+
+    pfd.fd=d->cdda_fd;
+    pfd.events=POLLIN;
+    ret=poll(&pfd,1,60000);
+    if(ret<0 && errno==EINTR)continue;
+
+    if(ret>0){
+      memset(&hdr,0,sizeof(hdr));
+      hdr.interface_id='S';
+      hdr.pack_id=-1;
+      if(read(d->cdda_fd,&hdr,sizeof(hdr))==sizeof(hdr))ret=1;
+      else if(errno==EAGAIN || errno==EINTR)continue;
+      else ret=-1;
+    }
+
+    if(ret<=0){
+      /* The command may yet complete and write into the buffer, so
+	 it can't be reused; let it go.  If that's the caller's buffer,
+	 its reply must never be read. */
+      if(r->direct)
+	d->private_data->abandoned=1;
+      else
+	r->dma=NULL;
+      return(-1);
+    }
+
+    /* a reply to a request that has since given up and been reused
+       doesn't match its pack_id; drop it */
+    q=hdr.usr_ptr;
+    if(q>=d->private_data->queue && 
+       q<d->private_data->queue+CDDA_QUEUE_DEPTH &&
+       !q->done && q->pack_id==hdr.pack_id){
+      q->hdr=hdr;
+      q->done=1;
+    }
+  }
+  tret2=clock_gettime(d->private_data->clock,&tv2);
+  if(tret1<0 || tret2<0){
+    d->private_data->last_milliseconds=-1;
+  }else{
+    d->private_data->last_milliseconds = (tv2.tv_sec-tv1.tv_sec)*1000 + (tv2.tv_nsec-tv1.tv_nsec)/1000000;
+  }
+
+  if(r->hdr.host_status || r->hdr.driver_status)return(-1);
+  if(r->hdr.status && check_sbp_error(r->hdr.status,r->sense))return(-1);
+
+  /* Did we get all the bytes we think we did?  If nothing at all
+     came back, the command failed quietly; a short reply is handed back short, as scsi_read_map() does. */
+  if(r->bytecheck){
+    i=sectors_returned(d,(r->direct?r->buffer:r->dma),r->sectors,
+		       r->hdr.resid);
+    if(i<=0)return(-1);
+  }else
+    i=r->sectors;
+
+  if(r->buffer && !r->direct)memcpy(r->buffer,r->dma,i*CD_FRAMESIZE_RAW);
+  return(i);
+}
+
+/* Queued reads need the sg character device; SG_IO on the block
+   device has no asynchronous form. */
+static void check_queueing(cdrom_drive *d){
+  struct stat st;
+  int version;
+
+  if(d->interface != SGIO_SCSI && d->interface != SGIO_SCSI_BUGGY1)return;
+  if(fstat(d->cdda_fd,&st) || !S_ISCHR(st.st_mode) ||
+     (int)(st.st_rdev>>8)!=SCSI_GENERIC_MAJOR)return;
+  if(ioctl(d->cdda_fd,SG_GET_VERSION_NUM,&version) || version<30000)return;
+
+  d->private_data->submit=sgio_submit;
+  d->private_data->reap=sgio_reap;
+  cdmessage(d,"\tQueueing reads on the generic SCSI device.\n");
+}
+
+/* tweak_SG_buffer() holds reads to 64kB because some drives (USB
+   bridges especially) fail large transfers without saying so.  Rather
+   than take either the queue limit or the 64kB guess on faith, read
+   real audio in progressively larger pieces and keep the largest that
+   comes back whole.  An error or a short read ends the walk. */
+
+static void probe_transfer_size(cdrom_drive *d){
+  unsigned char sense[SG_MAX_SENSE];
+  char buffer[256];
+  long good=d->nsectors,limit,sectors,sector=-1,longest=0;
+  int reserved,i,j;
+
+  if(d->interface != SGIO_SCSI && d->interface != SGIO_SCSI_BUGGY1)return;
+  if(ioctl(d->cdda_fd,SG_GET_RESERVED_SIZE,&reserved))return;
+  limit=reserved/CD_FRAMESIZE_RAW;
+  if(limit<=good)return;
+
+  for(i=0;read_maps[i].read_audio;i++)
+    if(read_maps[i].read_audio==d->read_audio)break;
+  if(!read_maps[i].map)return;
+
+  /* every probe reads from the start of the longest audio track */
+  for(j=1;j<=d->tracks;j++)
+    if(cdda_track_audiop(d,j)==1){
+      long first=cdda_track_firstsector(d,j);
+      long length=cdda_track_lastsector(d,j)-first+1;
+      if(length>longest){
+	longest=length;
+	sector=first;
+      }
+    }
+  if(sector<0)return;
+  if(limit>longest)limit=longest;
+
+  cdmessage(d,"\nProbing for the largest reliable transfer...\n");
+  d->enable_cdda(d,1);
+
+  while(good<limit){
+    void *hd;
+
+    sectors=(good*2>limit?limit:good*2);
+    if(!(hd=realloc(d->private_data->sg_hd,
+		    sectors*CD_FRAMESIZE_RAW + SG_OFF + 128)))break;
+    d->private_data->sg_hd=hd;
+    d->private_data->sg_buffer=((unsigned char *)hd)+SG_OFF;
+
+    errno=0;
+    if(read_maps[i].map(d,NULL,sector,sectors,sense)){
+      sprintf(buffer,"\t%ld sector read failed (%s); backing off.\n",
+	      sectors,errno?strerror(errno):"transport error");
+      cdmessage(d,buffer);
+      if(errno!=ENOMEM)reset_scsi(d);
+      break;
+    }
+
+    /* the same underrun check scsi_read_map() makes */
+    if(sectors_returned(d,d->private_data->sg_buffer,sectors,
+			d->private_data->resid)!=sectors){
+      sprintf(buffer,"\t%ld sector read came back short; backing off.\n",
+	      sectors);
+      cdmessage(d,buffer);
+      reset_scsi(d);
+      break;
+    }
+
+    good=sectors;
+  }
+
+  d->enable_cdda(d,0);
+  d->nsectors=good;
+  d->bigbuff=good*CD_FRAMESIZE_RAW;
+
+  sprintf(buffer,"\tSetting read size to %d sectors (%d bytes).\n\n",
+	  d->nsectors,d->nsectors*CD_FRAMESIZE_RAW);
+  cdmessage(d,buffer);
+}
+
 /* Some drives, given an audio read command, return only 2048 bytes
    of data as opposed to 2352 bytes.  Look for bytess at the end of the
    single sector verification read */
 
-static int count_2352_bytes(cdrom_drive *d){
+static int count_2352_bytes(unsigned char *buffer){
   long i;
   for(i=2351;i>=0;i--)
-    if(d->private_data->sg_buffer[i]!=(unsigned char)'\177')
+    if(buffer[i]!=(unsigned char)'\177')
       return(((i+3)>>2)<<2);
 
   return(0);
 }
 
-static int verify_nonzero(cdrom_drive *d){
+static int verify_nonzero(unsigned char *buffer){
   long i,flag=0;
   for(i=0;i<2352;i++)
-    if(d->private_data->sg_buffer[i]!=0){
+    if(buffer[i]!=0){
       flag=1;
       break;
     }
@@ -1292,6 +1629,184 @@ static int verify_nonzero(cdrom_drive *d){
   return(flag);
 }
 
+/* Drive profiles.  What verify_read_command(), check_cache(),
+   probe_transfer_size() and data_bigendianp() found for a drive is
+   kept in a text file, one line per drive and interface:
+
+     interface command density enable fua bigendianp nsectors model
+
+   command names a read_maps[] entry, enable is 0 for Dummy and 1 for
+   scsi_enable_cdda, and model (d->drive_model) runs to the end of the
+   line.  A later open of the same drive takes the line on the strength
+   of a single full-size read instead of probing again. */
+
+typedef struct {
+  int  interface;
+  char command[16];
+  int  density;
+  int  enable;
+  int  fua;
+  int  bigendianp;
+  int  nsectors;
+  char *model;   /* points into the parsed line */
+} drive_profile;
+
+/* parses (line) in place */
+static int profile_parse(char *line, drive_profile *p){
+  int n=0;
+  char *e;
+
+  if(sscanf(line,"%d %15s %d %d %d %d %d %n",&p->interface,p->command,
+	    &p->density,&p->enable,&p->fua,&p->bigendianp,&p->nsectors,&n)<7 ||
+     !n)
+    return(-1);
+  p->model=line+n;
+  if((e=strchr(p->model,'\n')))*e=0;
+  return(0);
+}
+
+/* One read of d->nsectors from the middle of an audio track, checked
+   the way verify_read_command() checks its single sector. */
+static int profile_sanity_read(cdrom_drive *d){
+  int i,ok=0;
+  void *hd;
+
+  if(!(hd=realloc(d->private_data->sg_hd,
+		  d->nsectors*CD_FRAMESIZE_RAW + SG_OFF + 128)))return(0);
+  d->private_data->sg_hd=hd;
+  d->private_data->sg_buffer=((unsigned char *)hd)+SG_OFF;
+
+  if(d->enable_cdda(d,1))return(0);
+  for(i=1;i<=d->tracks;i++){
+    if(cdda_track_audiop(d,i)==1){
+      long firstsector=cdda_track_firstsector(d,i);
+      long lastsector=cdda_track_lastsector(d,i);
+
+      if(lastsector-firstsector+1<d->nsectors)continue;
+      if(d->read_audio(d,NULL,(firstsector+lastsector-d->nsectors)>>1,
+		       d->nsectors)==d->nsectors)
+	ok=verify_nonzero(d->private_data->sg_buffer);
+      break;
+    }
+  }
+  d->enable_cdda(d,0);
+  return(ok);
+}
+
+static int load_profile(cdrom_drive *d){
+  char line[256],buffer[256];
+  drive_profile p;
+  FILE *f;
+  int i,found=0,reserved;
+
+  int  (*enable)(struct cdrom_drive *, int)=d->enable_cdda;
+  long (*read)(struct cdrom_drive *, void *, long, long)=d->read_audio;
+  unsigned char density=d->density;
+  int fua=d->fua;
+  int bigendianp=d->bigendianp;
+  int nsectors=d->nsectors;
+  long bigbuff=d->bigbuff;
+
+  if(!d->private_data->profile)return(0);
+  if(!(f=fopen(d->private_data->profile,"r")))return(0);
+  while(fgets(line,sizeof(line),f))
+    if(!profile_parse(line,&p) && p.interface==d->interface &&
+       !strcmp(p.model,d->drive_model)){
+      found=1;
+      break;
+    }
+  fclose(f);
+  if(!found)return(0);
+
+  /* no more than the kernel will transfer at once (see
+     probe_transfer_size()) */
+  if(ioctl(d->cdda_fd,SG_GET_RESERVED_SIZE,&reserved) || reserved<=0)
+    reserved=MAX_BIG_BUFF_SIZE;
+
+  for(i=0;read_maps[i].read_audio;i++)
+    if(!strcmp(read_maps[i].name,p.command))break;
+  if(!read_maps[i].read_audio || p.enable<0 || p.enable>1 ||
+     p.nsectors<1 || p.nsectors>reserved/CD_FRAMESIZE_RAW ||
+     p.bigendianp<-1 || p.bigendianp>1){
+    cdmessage(d,"\tIgnoring malformed drive profile entry.\n");
+    return(0);
+  }
+
+  sprintf(buffer,"\nChecking drive profile (%s, %d sectors)...\n",
+	  p.command,p.nsectors);
+  cdmessage(d,buffer);
+
+  d->read_audio=read_maps[i].read_audio;
+  d->enable_cdda=(p.enable?scsi_enable_cdda:Dummy);
+  d->density=p.density;
+  d->fua=p.fua;
+  if(d->bigendianp==-1)d->bigendianp=p.bigendianp;
+  d->nsectors=p.nsectors;
+  d->bigbuff=p.nsectors*CD_FRAMESIZE_RAW;
+
+  if(profile_sanity_read(d)){
+    cdmessage(d,"\tProfile reads OK; skipping drive probe.\n");
+    d->private_data->profiled=1;
+    return(1);
+  }
+
+  cdmessage(d,"\tProfile read FAILED; probing drive.\n");
+  d->read_audio=read;
+  d->enable_cdda=enable;
+  d->density=density;
+  d->fua=fua;
+  d->bigendianp=bigendianp;
+  d->nsectors=nsectors;
+  d->bigbuff=bigbuff;
+  return(0);
+}
+
+/* Called by cdda_open() once endianness is known.  Rewrites the
+   profile file with this drive's line replaced, by way of a temporary
+   file so that a failed write leaves the old profile intact. */
+void scsi_save_profile(cdrom_drive *d){
+  char line[256],copy[256];
+  drive_profile p;
+  char *temp;
+  FILE *in,*out;
+  int i;
+
+  if(!d->private_data->profile || d->private_data->profiled)return;
+  if(d->interface != GENERIC_SCSI && d->interface != SGIO_SCSI &&
+     d->interface != SGIO_SCSI_BUGGY1)return;
+  if(d->enable_cdda!=Dummy && d->enable_cdda!=scsi_enable_cdda)return;
+  for(i=0;read_maps[i].read_audio;i++)
+    if(read_maps[i].read_audio==d->read_audio)break;
+  if(!read_maps[i].read_audio)return;
+
+  temp=malloc(strlen(d->private_data->profile)+5);
+  sprintf(temp,"%s.new",d->private_data->profile);
+  if(!(out=fopen(temp,"w"))){
+    free(temp);
+    return;
+  }
+
+  if((in=fopen(d->private_data->profile,"r"))){
+    while(fgets(line,sizeof(line),in)){
+      strcpy(copy,line);
+      if(!profile_parse(copy,&p) && p.interface==d->interface &&
+	 !strcmp(p.model,d->drive_model))continue;
+      fputs(line,out);
+    }
+    fclose(in);
+  }
+
+  fprintf(out,"%d %s %d %d %d %d %d %s\n",d->interface,read_maps[i].name,
+	  d->density,(d->enable_cdda==scsi_enable_cdda),d->fua,
+	  d->bigendianp,d->nsectors,d->drive_model);
+
+  if(fclose(out) || rename(temp,d->private_data->profile)){
+    cderror(d,"\tUnable to write drive profile\n");
+    unlink(temp);
+  }
+  free(temp);
+}
+
 /* So many different read commands, densities, features...
    Verify that our selected 'read' command actually reads 
    nonzero data, else search through other possibilities */
@@ -1322,7 +1837,7 @@ static int verify_read_command(cdrom_drive *d){
 	audioflag=1;
 
 	if(d->read_audio(d,buff,sector,1)>0){
-	  if(count_2352_bytes(d)==2352){
+	  if(count_2352_bytes((unsigned char *)buff)==2352){
 	    cdmessage(d,"\tExpected command set reads OK.\n");
 	    d->enable_cdda(d,0);
 	    free(buff);
@@ -1483,8 +1998,8 @@ static int verify_read_command(cdrom_drive *d){
 		long sector=(firstsector+lastsector)>>1;
 		
 		if(d->read_audio(d,buff,sector,1)>0){
-		  if((lengthflag=count_2352_bytes(d))==2352){
-		    if(verify_nonzero(d)){
+		  if((lengthflag=count_2352_bytes((unsigned char *)buff))==2352){
+		    if(verify_nonzero((unsigned char *)buff)){
 		      cdmessage(d,"\t\tCommand set FOUND!\n");
 		      
 		      free(buff);
@@ -1721,8 +2236,12 @@ int scsi_init_drive(cdrom_drive *d){
   tweak_SG_buffer(d);
   d->opened=1;
 
-  if((ret=verify_read_command(d)))return(ret);
-  check_cache(d);
+  if(!load_profile(d)){
+    if((ret=verify_read_command(d)))return(ret);
+    check_cache(d);
+    probe_transfer_size(d);
+  }
+  check_queueing(d);
 
   d->error_retry=1;
   d->private_data->sg_hd=realloc(d->private_data->sg_hd,d->nsectors*CD_FRAMESIZE_RAW + SG_OFF + 128);
@@ -37,8 +37,7 @@
 #include "report.h"
 #include "version.h"
 #include "header.h"
-
-extern int analyze_cache(cdrom_drive *d, FILE *progress, FILE *log, int speed);
+#include "cachetest.h"
 
 static long parse_offset(cdrom_drive *d, char *offset, int begin){
   long track=-1;
@@ -251,6 +250,11 @@ VERSION"\n"
 "  -S --force-read-speed <n>       : read from device at specified speed; by\n"
 "                                    default, cdparanoia sets drive to full\n"
 "                                    speed.\n"
+"  -K --drive-profile <file>       : remember what probing finds out about\n"
+"                                    the drive in <file>, and reuse it on\n"
+"                                    later runs instead of probing again;\n"
+"                                    with -A, also record the drive's cache\n"
+"                                    behavior there for the cache model\n"
 "  -t --toc-offset <n>             : Add <n> sectors to the values reported\n"
 "                                    when addressing tracks. May be negative\n"
 "  -T --toc-bias                   : Assume that the beginning offset of \n"
@@ -266,7 +270,13 @@ VERSION"\n"
 "                                    retries without progress.\n"
 "  -Z --disable-paranoia           : disable all paranoia checking\n"
 "  -Y --disable-extra-paranoia     : only do cdda2wav-style overlap checking\n"
-"  -X --abort-on-skip              : abort on imperfect reads/skips\n\n"
+"  -X --abort-on-skip              : abort on imperfect reads/skips\n"
+"  -j --verify-threads <n>         : compare each read against earlier\n"
+"                                    reads on up to n threads\n"
+"  -P --prefetch                   : read the next block on a separate\n"
+"                                    thread while verifying the last\n"
+"  -M --adapt-cache                : size the drive cache model from how\n"
+"                                    cache flushing seeks time during the rip\n\n"
 
 "OUTPUT SMILIES:\n"
 "  :-)   Normal operation, low/no jitter\n"
@@ -607,7 +617,7 @@ static void callback(long inpos, int function){
     memset(dispcache,' ',graph);
 }
 
-const char *optstring = "escCn:o:O:d:g:k:S:prRwafvqVQhZz::YXWBi:Tt:l::L::A";
+const char *optstring = "escCn:o:O:d:g:k:S:prRwafvqVQhZz::YXWBi:Tt:l::L::Aj:PK:M";
 
 struct option options [] = {
 	{"stderr-progress",no_argument,NULL,'e'},
@@ -620,6 +630,7 @@ struct option options [] = {
 	{"force-cooked-device",required_argument,NULL,'k'},
 	{"force-generic-device",required_argument,NULL,'g'},
 	{"force-read-speed",required_argument,NULL,'S'},
+	{"drive-profile",required_argument,NULL,'K'},
 	{"sample-offset",required_argument,NULL,'O'},
 	{"toc-offset",required_argument,NULL,'t'},
 	{"toc-bias",no_argument,NULL,'T'},
@@ -639,6 +650,9 @@ struct option options [] = {
 	{"disable-paranoia",no_argument,NULL,'Z'},
 	{"disable-extra-paranoia",no_argument,NULL,'Y'},
 	{"abort-on-skip",no_argument,NULL,'X'},
+	{"verify-threads",required_argument,NULL,'j'},
+	{"prefetch",no_argument,NULL,'P'},
+	{"adapt-cache",no_argument,NULL,'M'},
 	{"disable-fragmentation",no_argument,NULL,'F'},
 	{"output-info",required_argument,NULL,'i'},
 	{"never-skip",optional_argument,NULL,'z'},
@@ -678,9 +692,13 @@ int main(int argc,char *argv[]){
   int force_cdrom_endian=-1;
   int force_cdrom_sectors=-1;
   int force_cdrom_overlap=-1;
+  int verify_threads=1;
+  int prefetch=0;
+  int adapt_cache=0;
   char *force_cdrom_device=NULL;
   char *force_generic_device=NULL;
   char *force_cooked_device=NULL;
+  char *drive_profile=NULL;
   int force_cdrom_speed=0;
   int max_retries=20;
   char *span=NULL;
@@ -700,6 +718,7 @@ int main(int argc,char *argv[]){
 
   char *info_file=NULL;
   int out;
+  buffered_writer *writer;
 
   int search=0;
   int c,long_option_index;
@@ -723,6 +742,15 @@ int main(int argc,char *argv[]){
     case 'o':
       force_cdrom_overlap=atoi(optarg);
       break;
+    case 'j':
+      verify_threads=atoi(optarg);
+      break;
+    case 'P':
+      prefetch=1;
+      break;
+    case 'M':
+      adapt_cache=1;
+      break;
     case 'd':
       if(force_cdrom_device)free(force_cdrom_device);
       force_cdrom_device=copystring(optarg);
@@ -736,6 +764,10 @@ int main(int argc,char *argv[]){
       if(force_generic_device)free(force_generic_device);
       force_generic_device=copystring(optarg);
       break;
+    case 'K':
+      if(drive_profile)free(drive_profile);
+      drive_profile=copystring(optarg);
+      break;
     case 'k':
       if(force_generic_device || force_cdrom_device){
 	report("-k option incompatable with -d and -g\n");
@@ -1021,6 +1053,8 @@ int main(int argc,char *argv[]){
 	   "ignoring autosense",force_cdrom_overlap);
   }
 
+  if(drive_profile)cdda_profile_set(d,drive_profile);
+
   switch(cdda_open(d)){
   case -2:case -3:case -4:case -5:
     report("\nUnable to open disc.  Is there an audio CD in the drive?");
@@ -1052,8 +1086,17 @@ int main(int argc,char *argv[]){
   }
   
   if(run_cache_test){
-    int warn=analyze_cache(d, stderr, reportfile, force_cdrom_speed);
+    cache_profile cp;
+    int warn=analyze_cache(d, stderr, reportfile, force_cdrom_speed, &cp);
     
+    if(drive_profile && warn>=0 && cp.cachesize>=0){
+      if(cache_profile_save(d, drive_profile, &cp)){
+	reportC("\nUnable to write cache results to %s\n",drive_profile);
+      }else{
+	reportC("\nCache results saved to %s\n",drive_profile);
+      }
+    }
+
     if(warn==0){
       reportC("\nDrive tests OK with Paranoia.\n\n");
       return 0;
@@ -1188,6 +1231,19 @@ int main(int argc,char *argv[]){
       p=paranoia_init(d);
       paranoia_modeset(p,paranoia_mode);
       if(force_cdrom_overlap!=-1)paranoia_overlapset(p,force_cdrom_overlap);
+      if(verify_threads>1)paranoia_threadset(p,verify_threads);
+      if(prefetch)paranoia_prefetchset(p,1);
+      if(adapt_cache)paranoia_cachemodel_adapt(p,1);
+      if(drive_profile){
+	cache_profile cp;
+	if(!cache_profile_load(d,drive_profile,&cp) && cp.cachesize>=0){
+	  paranoia_cachemodel_set(p,cp.cachesize,cp.readahead,cp.backseek);
+	  if(verbose)
+	    report("Using drive cache profile: %d sectors, %d readahead",
+		   paranoia_cachemodel_size(p,-1),
+		   (cp.readahead>0?cp.readahead:0));
+	}
+      }
 
       if(verbose)
         cdda_verbose_set(d,CDDA_MESSAGE_LOGIT,CDDA_MESSAGE_LOGIT);
@@ -1339,10 +1395,15 @@ int main(int argc,char *argv[]){
 	
 	/* Off we go! */
 
+	if(!(writer=buffering_open(out))){
+	  report("Error writing output: %s",strerror(errno));
+	  exit(1);
+	}
+
 	if(offset_buffer_used){
 	  /* partial sector from previous batch read */
 	  cursor++;
-	  if(buffering_write(out,
+	  if(buffering_write(writer,
 			     ((char *)offset_buffer)+offset_buffer_used,
 			     CD_FRAMESIZE_RAW-offset_buffer_used)){
 	    report("Error writing output: %s",strerror(errno));
@@ -1352,8 +1413,11 @@ int main(int argc,char *argv[]){
 	
 	skipped_flag=0;
 	while(cursor<=batch_last){
-	  /* read a sector */
-	  int16_t *readbuf=paranoia_read_limited(p,callback,max_retries);
+	  /* read a sector, and whatever follows it that paranoia has
+	     already verified */
+	  long sectors;
+	  int16_t *readbuf=paranoia_read_span(p,callback,max_retries,
+					      batch_last-cursor+1,&sectors);
 	  char *err=cdda_errors(d);
 	  char *mes=cdda_messages(d);
 
@@ -1379,30 +1443,24 @@ int main(int argc,char *argv[]){
 	  }
 
 	  skipped_flag=0;
-	  cursor++;
-	  
-	  if(output_endian!=bigendianp()){
-	    int i;
-	    for(i=0;i<CD_FRAMESIZE_RAW/2;i++)readbuf[i]=swap16(readbuf[i]);
-	  }
+	  cursor+=sectors;
 	  
 	  callback(cursor*(CD_FRAMEWORDS)-1,-2);
 
-	  if(buffering_write(out,((char *)readbuf)+offset_skip,
-			     CD_FRAMESIZE_RAW-offset_skip)){
+	  /* swap, if need be, on the way into the output buffer; readbuf
+	     belongs to paranoia and must be left as it is */
+	  if(output_endian!=bigendianp()?
+	     buffering_write_swapped(writer,((char *)readbuf)+offset_skip,
+				     sectors*CD_FRAMESIZE_RAW-offset_skip):
+	     buffering_write(writer,((char *)readbuf)+offset_skip,
+			     sectors*CD_FRAMESIZE_RAW-offset_skip)){
 	    report("Error writing output: %s",strerror(errno));
 	    exit(1);
 	  }
 	  offset_skip=0;
-	  
-	  if(output_endian!=bigendianp()){
-	    int i;
-	    for(i=0;i<CD_FRAMESIZE_RAW/2;i++)readbuf[i]=swap16(readbuf[i]);
-	  }
 
 	  /* One last bit of silliness to deal with sample offsets */
 	  if(sample_offset && cursor>batch_last){
-	    int i;
 	    /* read a sector and output the partial offset.  Save the
                rest for the next batch iteration */
 	    readbuf=paranoia_read_limited(p,callback,max_retries);
@@ -1425,15 +1483,14 @@ int main(int argc,char *argv[]){
 	    /* do not move the cursor */
 	  
 	    if(output_endian!=bigendianp())
-	      for(i=0;i<CD_FRAMESIZE_RAW/2;i++)
-		offset_buffer[i]=swap16(readbuf[i]);
+	      swap16_copy(offset_buffer,readbuf,CD_FRAMESIZE_RAW);
 	    else
 	      memcpy(offset_buffer,readbuf,CD_FRAMESIZE_RAW);
 	    offset_buffer_used=sample_offset*4;
 	  
 	    callback(cursor*(CD_FRAMEWORDS),-2);
 
-	    if(buffering_write(out,(char *)offset_buffer,
+	    if(buffering_write(writer,(char *)offset_buffer,
 			       offset_buffer_used)){
 	      report("Error writing output: %s",strerror(errno));
 	      exit(1);
@@ -1441,7 +1498,10 @@ int main(int argc,char *argv[]){
 	  }
 	}
 	callback(cursor*(CD_FRAMESIZE_RAW/2)-1,-1);
-	buffering_close(out);
+	if(buffering_close(writer) && !skipped_flag){
+	  report("Error writing output: %s",strerror(errno));
+	  exit(1);
+	}
 	if(skipped_flag){
 	  /* remove the file */
 	  report("\nRemoving aborted file: %s",outfile_name);
@@ -46,7 +46,20 @@ extern void paranoia_modeset(cdrom_paranoia *p,int mode);
 extern long paranoia_seek(cdrom_paranoia *p,long seek,int mode);
 extern int16_t *paranoia_read(cdrom_paranoia *p,void(*callback)(long,int));
 extern int16_t *paranoia_read_limited(cdrom_paranoia *p,void(*callback)(long,int),int maxretries);
+extern int16_t *paranoia_read_span(cdrom_paranoia *p,void(*callback)(long,int),
+				   int maxretries,long maxsectors,long *sectors);
 extern void paranoia_free(cdrom_paranoia *p);
 extern void paranoia_overlapset(cdrom_paranoia *p,long overlap);
+extern void paranoia_threadset(cdrom_paranoia *p,int threads);
+extern void paranoia_prefetchset(cdrom_paranoia *p,int onoff);
+extern void paranoia_probeset(cdrom_paranoia *p,int min,int max);
+extern void paranoia_probestats(cdrom_paranoia *p,long *tried,long *matched);
+extern void paranoia_sortstats(cdrom_paranoia *p,long *resets,long *wraps);
+extern void paranoia_bufferstats(cdrom_paranoia *p,long *current,long *peak);
+extern void paranoia_memoryset(cdrom_paranoia *p,long bytes);
+extern long paranoia_memoryusage(cdrom_paranoia *p);
 extern int paranoia_cachemodel_size(cdrom_paranoia *p,int sectors);
+extern void paranoia_cachemodel_set(cdrom_paranoia *p,int sectors,
+				    int readahead,int backseek);
+extern void paranoia_cachemodel_adapt(cdrom_paranoia *p,int onoff);
 #endif
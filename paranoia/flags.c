@@ -0,0 +1,142 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ *
+ * Bit plane storage for the per-sample c_block flags
+ *
+ ***/
+
+/* A byte of flags per sample spends five of its eight bits on nothing
+   and makes every 'where does the next unverified stretch begin'
+   question a byte-at-a-time walk.  Packing each flag into its own
+   plane costs three bits per sample and lets those walks, and the
+   EDGE/UNREAD stop tests done while extending a match, look at 64
+   samples per step. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "flags.h"
+
+#define PLANE(f,flag) ((f)->bits+(f)->words*__builtin_ctz(flag))
+
+flag_planes *flags_alloc(long size){
+  flag_planes *f=malloc(sizeof(flag_planes));
+  f->size=size;
+  f->words=(size+63)>>6;
+  f->bits=calloc(f->words*FLAG_PLANES,sizeof(u_int64_t));
+  return(f);
+}
+
+flag_planes *flags_dup(flag_planes *f){
+  flag_planes *ret=flags_alloc(f->size);
+  memcpy(ret->bits,f->bits,f->words*FLAG_PLANES*sizeof(u_int64_t));
+  return(ret);
+}
+
+void flags_free(flag_planes *f){
+  if(f){
+    free(f->bits);
+    free(f);
+  }
+}
+
+void flags_clear(flag_planes *f){
+  memset(f->bits,0,f->words*FLAG_PLANES*sizeof(u_int64_t));
+}
+
+void flags_set(flag_planes *f,long begin,long end,int flag){
+  u_int64_t *plane=PLANE(f,flag);
+  long wb,we;
+
+  if(begin<0)begin=0;
+  if(end>f->size)end=f->size;
+  if(begin>=end)return;
+
+  wb=begin>>6;
+  we=(end-1)>>6;
+  if(wb==we){
+    plane[wb]|=(~(u_int64_t)0>>(63-((end-1)&63)))&(~(u_int64_t)0<<(begin&63));
+    return;
+  }
+  plane[wb++]|=~(u_int64_t)0<<(begin&63);
+  while(wb<we)plane[wb++]=~(u_int64_t)0;
+  plane[we]|=~(u_int64_t)0>>(63-((end-1)&63));
+}
+
+void flags_or(flag_planes *dst,flag_planes *src,int flag){
+  u_int64_t *d=PLANE(dst,flag);
+  u_int64_t *s=PLANE(src,flag);
+  long i;
+
+  for(i=0;i<dst->words;i++)
+    d[i]|=s[i];
+}
+
+long flags_next(flag_planes *f,long from,long to,int flag,int state){
+  u_int64_t *plane=PLANE(f,flag);
+  u_int64_t invert=(state?0:~(u_int64_t)0);
+  long w,pos;
+
+  if(from<0)from=0;
+  if(to>f->size)to=f->size;
+  if(from>=to)return(to);
+
+  w=from>>6;
+  pos=w<<6;
+  {
+    u_int64_t m=(plane[w]^invert)&(~(u_int64_t)0<<(from&63));
+    while(!m){
+      pos+=64;
+      if(pos>=to)return(to);
+      m=plane[++w]^invert;
+    }
+    pos+=__builtin_ctzll(m);
+  }
+  return(pos<to?pos:to);
+}
+
+/* Sixty-four flags from (plane), starting at sample (pos); bit 0 is
+   sample pos.  Samples outside the plane read as clear. */
+static inline u_int64_t flags_window(u_int64_t *plane,long words,long pos){
+  long w=pos>>6;
+  int s=pos&63;
+  u_int64_t lo=(w>=0 && w<words?plane[w]:0);
+  u_int64_t hi=(w+1>=0 && w+1<words?plane[w+1]:0);
+
+  if(!s)return(lo);
+  return((lo>>s)|(hi<<(64-s)));
+}
+
+long flags_stop_f(flag_planes *A,long posA,flag_planes *B,long posB,long n){
+  u_int64_t *eA=PLANE(A,FLAGS_EDGE),*uA=PLANE(A,FLAGS_UNREAD);
+  u_int64_t *eB=PLANE(B,FLAGS_EDGE),*uB=PLANE(B,FLAGS_UNREAD);
+  long k;
+
+  for(k=0;k<n;k+=64){
+    u_int64_t m=
+      (flags_window(eA,A->words,posA+k)&flags_window(eB,B->words,posB+k))|
+      flags_window(uA,A->words,posA+k)|flags_window(uB,B->words,posB+k);
+    if(n-k<64)m&=((u_int64_t)1<<(n-k))-1;
+    if(m)return(k+__builtin_ctzll(m));
+  }
+  return(n);
+}
+
+long flags_stop_r(flag_planes *A,long posA,flag_planes *B,long posB,long n){
+  u_int64_t *eA=PLANE(A,FLAGS_EDGE),*uA=PLANE(A,FLAGS_UNREAD);
+  u_int64_t *eB=PLANE(B,FLAGS_EDGE),*uB=PLANE(B,FLAGS_UNREAD);
+  long k;
+
+  /* windows end at the current sample, so bit 63 is k and lower bits
+     walk further back */
+  for(k=0;k<n;k+=64){
+    long a=posA-k-63,b=posB-k-63;
+    u_int64_t m=
+      (flags_window(eA,A->words,a)&flags_window(eB,B->words,b))|
+      flags_window(uA,A->words,a)|flags_window(uB,B->words,b);
+    if(n-k<64)m&=~(u_int64_t)0<<(64-(n-k));
+    if(m)return(k+__builtin_clzll(m));
+  }
+  return(n);
+}
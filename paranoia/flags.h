@@ -0,0 +1,111 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ ***/
+
+#ifndef _FLAGS_H_
+#define _FLAGS_H_
+
+/* Per-sample c_block flags (FLAGS_EDGE, FLAGS_UNREAD, FLAGS_VERIFIED),
+   kept as one bit plane per flag rather than a byte per sample.  A
+   flag's plane is the bit number of its mask, so the masks must stay
+   single bits below 1<<FLAG_PLANES.  Bit j of word w in a plane is
+   sample w*64+j. */
+
+enum paranoia_flags {
+  FLAGS_EDGE    =0x1, /**< first/last N words of frame */
+  FLAGS_UNREAD  =0x2, /**< unread, hence missing and unmatchable */
+  FLAGS_VERIFIED=0x4  /**< block read and verified */
+};
+
+#define FLAG_PLANES 3
+
+typedef struct flag_planes{
+  long       size;            /* samples covered */
+  long       words;           /* 64-bit words in each plane */
+  u_int64_t *bits;            /* FLAG_PLANES planes of (words) words each */
+} flag_planes;
+
+/*! ========================================================================
+ * flags_alloc()
+ *
+ * Allocates flags for (size) samples, all clear.
+ */
+extern flag_planes *flags_alloc(long size);
+
+/*! ========================================================================
+ * flags_dup()
+ *
+ * Returns a copy of (f).
+ */
+extern flag_planes *flags_dup(flag_planes *f);
+
+/*! ========================================================================
+ * flags_free()
+ */
+extern void flags_free(flag_planes *f);
+
+/*! ========================================================================
+ * flags_clear()
+ *
+ * Clears every flag on every sample.
+ */
+extern void flags_clear(flag_planes *f);
+
+/*! ========================================================================
+ * flags_set()
+ *
+ * Sets (flag) on samples [begin,end); the range is clipped to the
+ * samples covered.
+ */
+extern void flags_set(flag_planes *f,long begin,long end,int flag);
+
+/*! ========================================================================
+ * flags_or()
+ *
+ * Sets (flag) in (dst) wherever it is set in (src), which must cover
+ * the same number of samples.
+ */
+extern void flags_or(flag_planes *dst,flag_planes *src,int flag);
+
+/*! ========================================================================
+ * flags_next()
+ *
+ * Returns the first sample in [from,to) on which (flag) is set (state
+ * nonzero) or clear (state zero), or (to) if there is none.
+ */
+extern long flags_next(flag_planes *f,long from,long to,int flag,int state);
+
+/*! ========================================================================
+ * flags_stop_f()
+ *
+ * Returns the first k in [0,n) at which samples posA+k of (A) and posB+k
+ * of (B) are both FLAGS_EDGE, or either is FLAGS_UNREAD; n if none.
+ */
+extern long flags_stop_f(flag_planes *A,long posA,flag_planes *B,long posB,
+			 long n);
+
+/*! ========================================================================
+ * flags_stop_r()
+ *
+ * As flags_stop_f(), but walks backward from posA and posB.
+ */
+extern long flags_stop_r(flag_planes *A,long posA,flag_planes *B,long posB,
+			 long n);
+
+/* ===========================================================================
+ * flags_test()
+ *
+ * Returns the subset of the flags in (mask) that are set on sample (pos).
+ */
+static inline int flags_test(flag_planes *f,long pos,int mask){
+  u_int64_t bit=(u_int64_t)1<<(pos&63);
+  u_int64_t *w=f->bits+(pos>>6);
+  int ret=0,plane;
+
+  for(plane=0;plane<FLAG_PLANES;plane++,w+=f->words)
+    if((mask&(1<<plane)) && (*w&bit))ret|=1<<plane;
+  return(ret);
+}
+
+#endif
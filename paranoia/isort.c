@@ -18,6 +18,25 @@
  * Collisions aren't due to hash collisions, as the table has one bucket
  * for each possible sample value.  Instead, the "collisions" represent
  * multiple occurrences of a given value.
+ *
+ * The SORT_FLAT layout holds the same information without the pointer
+ * chasing: a counting sort drops the positions of each value into one
+ * contiguous run of a flat array, and a per-value offset table says
+ * where each run begins and ends.  Positions are stored as 32-bit
+ * vector offsets, and lookups are a binary search over a short,
+ * contiguous run rather than a walk across a multi-megabyte
+ * allocation.
+ *
+ * With SORT_KGRAM, the flat index can also be searched on a run of
+ * SORT_GRAM samples.  Quiet and low-amplitude audio repeats individual
+ * values constantly, so a single-value lookup there turns up thousands
+ * of candidates, nearly all bogus; a run of four samples almost never
+ * repeats by accident.  Keying a second table on a hash of every gram
+ * in the vector costs more to build than it saves on ordinary audio,
+ * so the gram search reuses the value index instead: the first sample
+ * of the gram selects the run of candidates, and the whole gram is
+ * checked against each one as a single 64-bit key before it is
+ * returned.
  */
 
 #include <stdlib.h>
@@ -33,18 +52,29 @@
  * used to index up to (size) samples from a vector.
  */
 
-sort_info *sort_alloc(long size){
+sort_info *sort_alloc(long size,int mode){
   sort_info *ret=calloc(1,sizeof(sort_info));
 
   ret->vector=NULL;
   ret->sortbegin=-1;
   ret->size=-1;
   ret->maxsize=size;
+  ret->mode=mode&~SORT_KGRAM;
 
-  ret->head=calloc(65536,sizeof(sort_link *));
   ret->bucketusage=malloc(65536*sizeof(long));
-  ret->revindex=calloc(size,sizeof(sort_link));
   ret->lastbucket=0;
+  ret->stamp=calloc(65536,sizeof(u_int32_t));
+  ret->gen=1;
+
+  if(ret->mode==SORT_FLAT){
+    ret->bucketbegin=calloc(65536,sizeof(int32_t));
+    ret->bucketend=calloc(65536,sizeof(int32_t));
+    ret->positions=malloc(size*sizeof(int32_t));
+    ret->grams=(mode&SORT_KGRAM)!=0;
+  }else{
+    ret->head=calloc(65536,sizeof(sort_link *));
+    ret->revindex=calloc(size,sizeof(sort_link));
+  }
 
   return(ret);
 }
@@ -58,18 +88,18 @@ sort_info *sort_alloc(long size){
  */
 
 void sort_unsortall(sort_info *i){
-  /* If there were few enough different samples encountered (and hence few
-   * enough buckets used), we can just zero out those buckets.  If there
-   * were many (2000 is picked somewhat arbitrarily), it's faster simply to
-   * zero out all buckets with a memset() rather than walking the data
-   * structure and zeroing them out one by one.
+  /* A bucket only counts as in use if its stamp matches the current
+   * generation, so moving to the next generation empties every bucket
+   * at once; the stale heads and offsets are simply overwritten the
+   * next time each bucket is used.  The stamps need clearing for real
+   * only when the generation counter wraps.
    */
-  if(i->lastbucket>2000){ /* a guess */
-    memset(i->head,0,65536*sizeof(sort_link *));
-  }else{
-    long b;
-    for(b=0;b<i->lastbucket;b++)
-      i->head[i->bucketusage[b]]=NULL;
+  i->gen++;
+  i->resets++;
+  if(i->gen==0){
+    memset(i->stamp,0,65536*sizeof(u_int32_t));
+    i->gen=1;
+    i->wraps++;
   }
 
   i->lastbucket=0;
@@ -89,11 +119,25 @@ void sort_unsortall(sort_info *i){
  */
 
 void sort_free(sort_info *i){
-  free(i->revindex);
-  free(i->head);
+  if(i->revindex)free(i->revindex);
+  if(i->head)free(i->head);
+  if(i->bucketbegin)free(i->bucketbegin);
+  if(i->bucketend)free(i->bucketend);
+  if(i->positions)free(i->positions);
   free(i->bucketusage);
+  free(i->stamp);
   free(i);
 }
+
+long sort_bytes(sort_info *i){
+  long ret=sizeof(sort_info)+65536*(sizeof(long)+sizeof(u_int32_t));
+
+  if(i->mode==SORT_FLAT)
+    ret+=65536*2*sizeof(int32_t)+i->maxsize*sizeof(int32_t);
+  else
+    ret+=65536*sizeof(sort_link *)+i->maxsize*sizeof(sort_link);
+  return(ret);
+}
  
 
 /* ===========================================================================
@@ -107,6 +151,47 @@ void sort_free(sort_info *i){
 static void sort_sort(sort_info *i,long sortlo,long sorthi){
   long j;
 
+  if(i->mode==SORT_FLAT){
+    long b,slot=0;
+
+    /* Count the occurrences of each value, claiming each bucket for
+     * this generation the first time we see it and noting it so that
+     * we only lay out the buckets actually in use.  bucketend holds the
+     * count until the layout pass below.
+     */
+    for(j=sortlo;j<sorthi;j++){
+      long v=i->vector[j]+32768;
+      if(i->stamp[v]!=i->gen){
+	i->stamp[v]=i->gen;
+	i->bucketend[v]=0;
+	i->bucketusage[i->lastbucket]=v;
+	i->lastbucket++;
+      }
+      i->bucketend[v]++;
+    }
+
+    /* Give each used bucket a contiguous run of slots.  Which order
+     * the runs are laid out in doesn't matter; order of first
+     * appearance is free.  bucketend becomes the fill pointer.
+     */
+    for(b=0;b<i->lastbucket;b++){
+      long v=i->bucketusage[b];
+      i->bucketbegin[v]=slot;
+      slot+=i->bucketend[v];
+      i->bucketend[v]=i->bucketbegin[v];
+    }
+
+    /* Scatter the positions.  Walking forward leaves each run sorted
+     * from first to last occurrence, and each fill pointer finishes
+     * one past the end of its run.
+     */
+    for(j=sortlo;j<sorthi;j++)
+      i->positions[i->bucketend[i->vector[j]+32768]++]=j;
+
+    i->sortbegin=0;
+    return;
+  }
+
   /* We walk backward through the range to index because we insert new
    * samples at the head of each bucket's list.  At the end, they'll be
    * sorted from first to last occurrence.
@@ -127,13 +212,13 @@ static void sort_sort(sort_info *i,long sortlo,long sorthi){
     sort_link **hv=i->head+i->vector[j]+32768;
     sort_link *l=i->revindex+j;
 
-    /* If this is the first time we've encountered this sample, add its
-     * bucket to the list of buckets used.  This list is used only for
-     * resetting the index quickly.
+    /* If this is the first time we've encountered this sample in this
+     * generation, whatever the head holds is left over from an earlier
+     * one; start the list afresh.
      */
-    if(*hv==NULL){
-      i->bucketusage[i->lastbucket]=i->vector[j]+32768;
-      i->lastbucket++;
+    if(i->stamp[i->vector[j]+32768]!=i->gen){
+      i->stamp[i->vector[j]+32768]=i->gen;
+      *hv=NULL;
     }
 
     /* Point the new node at the old head, then assign the new node as
@@ -159,8 +244,8 @@ static void sort_sort(sort_info *i,long sortlo,long sorthi){
  * will eventually be indexed for fast searching.  (sortlo, sorthi)
  * are absolute sample positions.
  *
- * Note: size *must* be <= the size given to the preceding sort_alloc(),
- * but no error checking is done here.
+ * If (size) is larger than the index was allocated for, the per-sample
+ * storage grows to fit.
  */
 
 void sort_setup(sort_info *i,int16_t *vector,long *abspos,
@@ -169,6 +254,18 @@ void sort_setup(sort_info *i,int16_t *vector,long *abspos,
    */
   if(i->sortbegin!=-1)sort_unsortall(i);
 
+  /* The cache model, and with it the size of a c_block, can grow
+   * after the index was allocated.  Any old links are already stale
+   * (see sort_unsortall()), so the per-sample storage can simply move.
+   */
+  if(size>i->maxsize){
+    if(i->mode==SORT_FLAT)
+      i->positions=realloc(i->positions,size*sizeof(int32_t));
+    else
+      i->revindex=realloc(i->revindex,size*sizeof(sort_link));
+    i->maxsize=size;
+  }
+
   i->vector=vector;
   i->size=size;
   i->abspos=abspos;
@@ -181,19 +278,27 @@ void sort_setup(sort_info *i,int16_t *vector,long *abspos,
   i->hi=max(0,min(sorthi-*abspos,size));
 }
 
+/* ===========================================================================
+ * sort_build()
+ *
+ * Builds the index now rather than on the first search.
+ */
+
+void sort_build(sort_info *i){
+  if(i->sortbegin==-1)sort_sort(i,i->lo,i->hi);
+}
+
 /* ===========================================================================
  * sort_getmatch()
  *
- * This function returns a sort_link_t pointer which refers to the
- * first sample equal to (value) in the vector.  It only searches for
- * hits within (overlap) samples of (post), where (post) is an offset
- * within the vector.  The caller can determine the position of the
- * matched sample using ipos(sort_info *, sort_link *).
+ * This function returns the offset within the vector of the first
+ * sample equal to (value).  It only searches for hits within (overlap)
+ * samples of (post), where (post) is an offset within the vector.
  *
- * This function returns NULL if no matches were found.
+ * This function returns -1 if no matches were found.
  */
 
-sort_link *sort_getmatch(sort_info *i,long post,long overlap,int value){
+long sort_getmatch(sort_info *i,long post,long overlap,int value){
   sort_link *ret;
 
   /* If the vector hasn't been indexed yet, index it now.
@@ -213,9 +318,33 @@ sort_link *sort_getmatch(sort_info *i,long post,long overlap,int value){
   i->lo=max(0,post-overlap);       /* absolute position */
   i->hi=min(i->size,post+overlap); /* absolute position */
 
+  /* A bucket from an earlier generation is empty. */
+  if(i->stamp[i->val]!=i->gen)return(-1);
+
+  if(i->mode==SORT_FLAT){
+    /* Binary search this value's run of positions for the first one
+     * at or after lo.
+     */
+    long lo=i->bucketbegin[i->val];
+    long hi=i->bucketend[i->val];
+
+    while(lo<hi){
+      long mid=(lo+hi)>>1;
+      if(i->positions[mid]<i->lo)
+	lo=mid+1;
+      else
+	hi=mid;
+    }
+
+    i->cursor=lo;
+    if(lo<i->bucketend[i->val] && i->positions[lo]<i->hi)
+      return(i->positions[lo]);
+    return(-1);
+  }
+
   /* Walk through the linked list of samples with this value, until
    * we find the first one within the bounds specified.  If there
-   * aren't any, return NULL.
+   * aren't any, return -1.
    */
   ret=i->head[i->val];
 
@@ -233,28 +362,108 @@ sort_link *sort_getmatch(sort_info *i,long post,long overlap,int value){
     }
   }
   /*i->head[i->val]=ret;*/
-  return(ret);
+  return(ret?ipos(i,ret):-1);
 }
 
 
 /* ===========================================================================
  * sort_nextmatch()
  *
- * This function returns a sort_link_t pointer which refers to the next sample
- * matching the criteria previously passed to sort_getmatch().  See
- * sort_getmatch() for details.
+ * This function returns the offset of the next sample matching the
+ * criteria previously passed to sort_getmatch().  (prev) must be the
+ * offset returned by the preceding sort_getmatch()/sort_nextmatch()
+ * call.  See sort_getmatch() for details.
  *
- * This function returns NULL if no further matches were found.
+ * This function returns -1 if no further matches were found.
  */
 
-sort_link *sort_nextmatch(sort_info *i,sort_link *prev){
-  sort_link *ret=prev->next;
+long sort_nextmatch(sort_info *i,long prev){
+  sort_link *ret;
+
+  if(i->mode==SORT_FLAT){
+    i->cursor++;
+    if(i->cursor>=i->bucketend[i->val] || i->positions[i->cursor]>=i->hi)
+      return(-1);
+    return(i->positions[i->cursor]);
+  }
+
+  ret=i->revindex[prev].next;
 
   /* If there aren't any more hits, or we've passed the boundary requested
    * of sort_getmatch(), we're done.
    */
-  if(!ret || ipos(i,ret)>=i->hi)return(NULL); 
+  if(!ret || ipos(i,ret)>=i->hi)return(-1); 
 
-  return(ret);
+  return(ipos(i,ret));
+}
+
+
+/* ===========================================================================
+ * Gram helpers (internal)
+ *
+ * A gram is packed into a 64-bit key by copying its samples straight
+ * out of memory; the byte order doesn't matter as long as both sides
+ * of a comparison are packed the same way.
+ */
+
+static inline u_int64_t gram_key(int16_t *v){
+  u_int64_t key;
+  memcpy(&key,v,sizeof(key));
+  return(key);
+}
+
+/* ===========================================================================
+ * sort_gramhit() (internal)
+ *
+ * Starting at slot (i->cursor) of the current value's run, skips to the
+ * first position whose gram is the one being searched for.  Returns
+ * that position, or -1 once the run or the search range is exhausted.
+ */
+
+static inline long sort_gramhit(sort_info *i){
+  long end=i->bucketend[i->val];
+  long last=min(i->hi,i->size-SORT_GRAM+1);
+
+  for(;i->cursor<end;i->cursor++){
+    long pos=i->positions[i->cursor];
+    if(pos>=last)break;
+    if(gram_key(i->vector+pos)==i->want)return(pos);
+  }
+  return(-1);
+}
+
+
+/* ===========================================================================
+ * sort_getgram()
+ *
+ * Like sort_getmatch(), but returns the offset of the first place
+ * within (overlap) samples of (post) where the SORT_GRAM samples
+ * starting at (gram) occur.  The index must have been allocated with
+ * SORT_FLAT|SORT_KGRAM.
+ *
+ * This function returns -1 if no matches were found.
+ */
+
+long sort_getgram(sort_info *i,long post,long overlap,int16_t *gram){
+  /* The first sample of the gram picks the run of candidates; the
+   * rest are checked with one 64-bit compare per candidate, which is
+   * far cheaper than letting each one fail a run extension.
+   */
+  i->want=gram_key(gram);
+  if(sort_getmatch(i,post,overlap,gram[0])==-1)return(-1);
+  return(sort_gramhit(i));
 }
 
+
+/* ===========================================================================
+ * sort_nextgram()
+ *
+ * Like sort_nextmatch(), for the search begun by sort_getgram().
+ *
+ * This function returns -1 if no further matches were found.
+ */
+
+long sort_nextgram(sort_info *i){
+  i->cursor++;
+  return(sort_gramhit(i));
+}
@@ -10,6 +10,15 @@ typedef struct sort_link{
   struct sort_link *next;
 } sort_link;
 
+/* index layouts, selected at sort_alloc() time */
+#define SORT_LINKED 0  /* per-sample linked lists off 65536 bucket heads */
+#define SORT_FLAT   1  /* counting sort into one contiguous position array */
+
+/* may be or'ed into SORT_FLAT: also answer searches on runs of
+   SORT_GRAM samples (see sort_getgram()) */
+#define SORT_KGRAM   2
+#define SORT_GRAM    4  /* samples per gram; four fit in 64 bits */
+
 typedef struct sort_info{
   int16_t *vector;                /* vector (storage doesn't belong to us) */
 
@@ -18,6 +27,9 @@ typedef struct sort_info{
 
   long  maxsize;                 /* maximum vector size */
 
+  int   mode;                    /* SORT_LINKED or SORT_FLAT */
+  int   grams;                   /* SORT_KGRAM was requested */
+
   long sortbegin;                /* range of contiguous sorted area */
   long lo,hi;                    /* current post, overlap range */
   int  val;                      /* ...and val */
@@ -27,23 +39,38 @@ typedef struct sort_info{
 
   long *bucketusage;          /*  of used buckets (65536) */
   long lastbucket;
+  u_int32_t *stamp;           /* generation each bucket was last used (65536) */
+  u_int32_t gen;              /* current generation */
+  long resets;                /* sort_unsortall() calls */
+  long wraps;                 /* ...that had to clear the stamps */
   sort_link *revindex;
 
+  /* flat sort structs */
+  int32_t *bucketbegin;       /* first slot of each value in positions (65536) */
+  int32_t *bucketend;         /* one past the last slot (65536) */
+  int32_t *positions;         /* vector offsets, grouped by value, ascending */
+  long cursor;                /* slot of the most recently returned match */
+
+  u_int64_t want;             /* gram being searched for (SORT_KGRAM) */
+
 } sort_info;
 
 /*! ========================================================================
  * sort_alloc()
  *
  * Allocates and initializes a new, empty sort_info object, which can
- * be used to index up to (size) samples from a vector.
+ * be used to index up to (size) samples from a vector.  (mode) selects
+ * the index layout: SORT_LINKED or SORT_FLAT.  SORT_KGRAM may be or'ed
+ * into SORT_FLAT to enable sort_getgram().
  */
-extern sort_info *sort_alloc(long size);
+extern sort_info *sort_alloc(long size,int mode);
 
 /*! ========================================================================
  * sort_unsortall() (internal)
  *
  * This function resets the index for further use with a different
  * vector or range, without the overhead of an unnecessary free/alloc.
+ * The reset is O(1); (resets) and (wraps) count how often it happens.
  */
 extern void sort_unsortall(sort_info *i);
 
@@ -57,8 +84,8 @@ extern void sort_unsortall(sort_info *i);
  * will eventually be indexed for fast searching.  (sortlo, sorthi)
  * are absolute sample positions.
  *
- * Note: size *must* be <= the size given to the preceding sort_alloc(),
- * but no error checking is done here.
+ * If (size) is larger than the index was allocated for, the index
+ * grows to fit.
  */
 extern void sort_setup(sort_info *i,int16_t *vector,long *abspos,long size,
 		       long sortlo, long sorthi);
@@ -70,29 +97,65 @@ extern void sort_setup(sort_info *i,int16_t *vector,long *abspos,long size,
  */
 extern void sort_free(sort_info *i);
 
+/* =========================================================================
+ * sort_bytes()
+ *
+ * Returns the memory consumed by a sort_info object, in bytes.
+ */
+extern long sort_bytes(sort_info *i);
+
+/*! ========================================================================
+ * sort_build()
+ *
+ * Builds the index now rather than on the first search.  Once built,
+ * the index is only read by searches, so several threads can search
+ * it at once, each through its own copy of the sort_info.
+ */
+extern void sort_build(sort_info *i);
+
 /*! ========================================================================
  * sort_getmatch()
  *
- * This function returns a sort_link_t pointer which refers to the
- * first sample equal to (value) in the vector.  It only searches for
- * hits within (overlap) samples of (post), where (post) is an offset
- * within the vector.  The caller can determine the position of the
- * matched sample using ipos(sort_info *, sort_link *).
+ * This function returns the offset within the vector of the first
+ * sample equal to (value).  It only searches for hits within (overlap)
+ * samples of (post), where (post) is an offset within the vector.
  *
- * This function returns NULL if no matches were found.
+ * This function returns -1 if no matches were found.
  */
-extern sort_link *sort_getmatch(sort_info *i,long post,long overlap,int value);
+extern long sort_getmatch(sort_info *i,long post,long overlap,int value);
 
 /*! ========================================================================
  * sort_nextmatch()
  *
- * This function returns a sort_link_t pointer which refers to the
- * next sample matching the criteria previously passed to
- * sort_getmatch().  See sort_getmatch() for details.
+ * This function returns the offset of the next sample matching the
+ * criteria previously passed to sort_getmatch().  (prev) must be the
+ * offset returned by the preceding sort_getmatch()/sort_nextmatch()
+ * call.  See sort_getmatch() for details.
+ *
+ * This function returns -1 if no further matches were found.
+ */
+extern long sort_nextmatch(sort_info *i,long prev);
+
+/*! ========================================================================
+ * sort_getgram()
+ *
+ * Like sort_getmatch(), but returns the offset of the first place
+ * within (overlap) samples of (post) where the SORT_GRAM samples
+ * starting at (gram) occur.  The index must have been allocated with
+ * SORT_FLAT|SORT_KGRAM.
+ *
+ * This function returns -1 if no matches were found.
+ */
+extern long sort_getgram(sort_info *i,long post,long overlap,int16_t *gram);
+
+/*! ========================================================================
+ * sort_nextgram()
+ *
+ * Like sort_nextmatch(), for the search begun by sort_getgram().
  *
- * This function returns NULL if no further matches were found.
+ * This function returns -1 if no further matches were found.
  */
-extern sort_link *sort_nextmatch(sort_info *i,sort_link *prev);
+extern long sort_nextgram(sort_info *i);
 
 /* ===========================================================================
  * is()
@@ -125,10 +188,10 @@ extern sort_link *sort_nextmatch(sort_info *i,sort_link *prev);
 #define iv(i) (i->vector)
 
 /* ===========================================================================
- * ipos()
+ * ipos() (internal)
  *
  * This macro returns the relative position (offset) within the indexed vector
- * at which the given match was found.
+ * of the given sort_link (SORT_LINKED only).
  *
  * It uses a little-known and frightening aspect of C pointer arithmetic:
  * subtracting a pointer is not an arithmetic subtraction, but rather the
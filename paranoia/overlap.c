@@ -119,12 +119,14 @@ void offset_adjust_settings(cdrom_paranoia *p, void(*callback)(long,int)){
 	c_block *c=c_first(p);
 	v_fragment *v=v_first(p);
 
-	while(v && v->one){
+	while(v){
 	  /* safeguard beginning bounds case with a hammer */
-	  if(fb(v)<av || cb(v->one)<av){
-	    v->one=NULL;
-	  }else{
-	    fb(v)-=av;
+	  if(v->one){
+	    if(fb(v)<av || cb(v->one)<av){
+	      v->one=NULL;
+	    }else{
+	      fb(v)-=av;
+	    }
 	  }
 	  v=v_next(v);
 	}
@@ -5,28 +5,89 @@
 #include "p_block.h"
 #include "../interface/cdda_interface.h"
 #include "cdda_paranoia.h"
+#include "simd.h"
+
+/**** Slab allocation ****************************************************/
+
+/* List nodes, c_blocks and v_fragments are small and come and go by
+   the thousand on a damaged disc (every verified run in stage 1 is a
+   v_fragment).  Taking them from a few pages per object type keeps
+   them packed together and keeps malloc out of the matching loops. */
+
+#define SLAB_PAGE 4096
+
+slab *slab_new(long size){
+  slab *s=calloc(1,sizeof(slab));
+  s->size=(size+sizeof(void *)-1)/sizeof(void *)*sizeof(void *);
+  s->perpage=max(SLAB_PAGE/s->size,1);
+  s->used=s->perpage;
+  return(s);
+}
+
+void *slab_get(slab *s){
+  void *ret;
+
+  if(s->free){
+    ret=s->free;
+    s->free=*(void **)ret;
+  }else{
+    if(s->used>=s->perpage){
+      s->pages=realloc(s->pages,(s->npages+1)*sizeof(void *));
+      s->pages[s->npages++]=malloc(s->perpage*s->size);
+      s->used=0;
+    }
+    ret=(char *)s->pages[s->npages-1]+s->used++*s->size;
+  }
+  memset(ret,0,s->size);
+  return(ret);
+}
+
+void slab_put(slab *s,void *obj){
+  *(void **)obj=s->free;
+  s->free=obj;
+}
+
+void slab_free(slab *s){
+  if(s){
+    while(s->npages)free(s->pages[--s->npages]);
+    free(s->pages);
+    free(s);
+  }
+}
+
+/**** Linked lists *******************************************************/
 
 linked_list *new_list(void *(*newp)(void),void (*freep)(void *)){
   linked_list *ret=calloc(1,sizeof(linked_list));
   ret->new_poly=newp;
   ret->free_poly=freep;
+  ret->nodes=slab_new(sizeof(linked_element));
   return(ret);
 }
 
 linked_element *add_elem(linked_list *l,void *elem){
+  return(insert_elem(l,NULL,elem));
+}
+
+/* inserts just after (after); NULL inserts at the head */
+linked_element *insert_elem(linked_list *l,linked_element *after,void *elem){
 
-  linked_element *ret=calloc(1,sizeof(linked_element));
+  linked_element *ret=slab_get(l->nodes);
+  linked_element *next=(after?after->next:l->head);
   ret->stamp=l->current++;
   ret->ptr=elem;
   ret->list=l;
 
-  if(l->head)
-    l->head->prev=ret;
+  if(next)
+    next->prev=ret;
   else
     l->tail=ret;    
-  ret->next=l->head;
-  ret->prev=NULL;
-  l->head=ret;
+  if(after)
+    after->next=ret;
+  else
+    l->head=ret;
+  ret->next=next;
+  ret->prev=after;
   l->active++;
 
   return(ret);
@@ -52,12 +113,13 @@ void free_elem(linked_element *e,int free_ptr){
     e->next->prev=e->prev;
 
   l->active--;
-  free(e);
+  slab_put(l->nodes,e);
 } 
 
 void free_list(linked_list *list,int free_ptr){
   while(list->head)
     free_elem(list->head,free_ptr);
+  slab_free(list->nodes);
   free(list);
 }
 
@@ -78,23 +140,29 @@ linked_list *copy_list(linked_list *list){
 
 /**** C_block stuff ******************************************************/
 
-static c_block *i_cblock_constructor(cdrom_paranoia *p){
-  c_block *ret=calloc(1,sizeof(c_block));
-  return(ret);
-}
-
 void i_cblock_destructor(c_block *c){
   if(c){
-    if(c->vector)free(c->vector);
-    if(c->flags)free(c->flags);
+    if(c->p && !c->buffer){
+      /* a cache c_block; its storage came from c_buffer_get() */
+      c_buffer_put(c->p,c->vector,c->alloc,c->flags);
+    }else{
+      if(c->buffer)
+	free(c->buffer);
+      else
+	if(c->vector)free(c->vector);
+      flags_free(c->flags);
+    }
     c->e=NULL;
-    free(c);
+    if(c->p)
+      slab_put(c->p->cblocks,c);
+    else
+      free(c);
   }
 }
 
 c_block *new_c_block(cdrom_paranoia *p){
-  linked_element *e=new_elem(p->cache);
-  c_block *c=e->ptr;
+  c_block *c=slab_get(p->cblocks);
+  linked_element *e=add_elem(p->cache,c);
   c->e=e;
   c->p=p;
   return(c);
@@ -113,19 +181,29 @@ void free_c_block(c_block *c){
   free_elem(c->e,1);
 }
 
-static v_fragment *i_vfragment_constructor(void){
-  v_fragment *ret=calloc(1,sizeof(v_fragment));
-  return(ret);
-}
-
 static void i_v_fragment_destructor(v_fragment *v){
-  free(v);
+  slab_put(v->p->vfragments,v);
 }
 
+/* p->fragments is kept in order of ascending begin (lowest at the
+   head) so that stage 2 can walk it in order and stop once it's past
+   the root.  Fragments orphaned by drift correction (one==NULL) are
+   dead weight and don't count toward the ordering.  New fragments
+   nearly always belong at or near the tail. */
 v_fragment *new_v_fragment(cdrom_paranoia *p,c_block *one,
 			   long begin, long end, int last){
-  linked_element *e=new_elem(p->fragments);
-  v_fragment *b=e->ptr;
+  linked_list *l=p->fragments;
+  linked_element *after=l->tail;
+  linked_element *e;
+  v_fragment *b;
+
+  while(after){
+    v_fragment *v=after->ptr;
+    if(v->one && v->begin<=begin)break;
+    after=after->prev;
+  }
+  e=insert_elem(l,after,slab_get(p->vfragments));
+  b=e->ptr;
   
   b->e=e;
   b->p=p;
@@ -202,12 +280,148 @@ void recover_cache(cdrom_paranoia *p){
 
 }
 
+static long slab_bytes(slab *s){
+  return(s->npages*(s->perpage*s->size+sizeof(void *)));
+}
+
+/* Everything a cdrom_paranoia holds that grows with the work it's
+   doing: c_block storage (in use and spare), the verified root, the
+   sort index and the small objects in the slabs.  Threaded stage 1's
+   short-lived copies of the flags aren't counted. */
+long i_paranoia_memory(cdrom_paranoia *p){
+  buffer_pool *b=&p->buffers;
+  c_block *root=p->root.vector;
+  long ret=b->current;
+
+  ret+=b->nvectors*b->samples*sizeof(int16_t);
+  if(b->nflags)
+    ret+=b->nflags*b->flags[0]->words*FLAG_PLANES*sizeof(u_int64_t);
+
+  if(root)
+    ret+=(root->buffer?root->alloc:cs(root))*sizeof(int16_t);
+
+  ret+=sort_bytes(p->sortcache);
+  ret+=slab_bytes(p->cblocks)+slab_bytes(p->vfragments);
+  ret+=slab_bytes(p->cache->nodes)+slab_bytes(p->fragments->nodes);
+  return(ret);
+}
+
+/* With a memory limit set, makes room for (need) more bytes by
+   dropping spare c_block storage and then freeing c_blocks (and with
+   them their v_fragments), oldest first.  The newest c_block is never
+   freed; the read being made room for needs something to overlap, and
+   with prefetching it's the one about to be verified.  Returns nonzero
+   if (need) now fits. */
+int recover_memory(cdrom_paranoia *p,long need){
+  if(p->memory_limit<=0)return(1);
+
+  while(i_paranoia_memory(p)+need>p->memory_limit){
+    c_block *c=c_last(p);
+
+    if(p->buffers.nvectors || p->buffers.nflags)
+      c_buffer_drain(p);
+    else if(c && c!=c_first(p))
+      free_c_block(c);
+    else
+      return(0);
+  }
+  return(1);
+}
+
 int16_t *v_buffer(v_fragment *v){
   if(!v->one)return(NULL);
   if(!cv(v->one))return(NULL);
   return(v->vector);
 }
 
+/**** C_block storage ****************************************************/
+
+/* Every read pass fills a c_block of cdcache_size sectors, and the
+   oldest c_block is retired at about the same rate, so rather than
+   going back to malloc each time, retired audio buffers and flags
+   are kept on spare lists in p->buffers and handed to the next read.
+   Audio buffers are page aligned, which is what a driver doing DMA
+   straight into them wants.  All buffers in the pool are the same
+   size; if the size asked for changes (the cache model was resized),
+   the spares are dropped and buffers of the old size are freed as
+   they come back.  The pool holds at most cache_limit spares
+   of each kind, which is as many c_blocks as the cache keeps.
+   c_buffer_get() returns NULL, handing out no flags, if the audio
+   buffer can't be had even with the spares given back. */
+
+#define BUFFER_ALIGN 4096
+
+int16_t *c_buffer_get(cdrom_paranoia *p,long samples,flag_planes **flags){
+  buffer_pool *b=&p->buffers;
+  int16_t *ret=NULL;
+
+  if(samples!=b->samples){
+    c_buffer_drain(p);
+    b->samples=samples;
+  }
+
+  if(b->nvectors)
+    ret=b->vectors[--b->nvectors];
+  else if(posix_memalign((void **)&ret,BUFFER_ALIGN,samples*sizeof(int16_t))){
+    /* out of memory; give back the spares and try once more */
+    c_buffer_drain(p);
+    if(posix_memalign((void **)&ret,BUFFER_ALIGN,samples*sizeof(int16_t)))
+      ret=NULL;
+  }
+  if(!ret){
+    if(flags)*flags=NULL;
+    return(NULL);
+  }
+  b->current+=samples*sizeof(int16_t);
+
+  if(flags){
+    if(b->nflags){
+      *flags=b->flags[--b->nflags];
+      flags_clear(*flags);
+    }else
+      *flags=flags_alloc(samples);
+    b->current+=(*flags)->words*FLAG_PLANES*sizeof(u_int64_t);
+  }
+
+  if(b->current>b->peak)b->peak=b->current;
+  return(ret);
+}
+
+void c_buffer_put(cdrom_paranoia *p,int16_t *vector,long samples,
+		  flag_planes *flags){
+  buffer_pool *b=&p->buffers;
+
+  if(b->alloc<p->cache_limit){
+    b->alloc=p->cache_limit;
+    b->vectors=realloc(b->vectors,b->alloc*sizeof(*b->vectors));
+    b->flags=realloc(b->flags,b->alloc*sizeof(*b->flags));
+  }
+
+  if(vector){
+    b->current-=samples*sizeof(int16_t);
+    if(samples==b->samples && b->nvectors<b->alloc)
+      b->vectors[b->nvectors++]=vector;
+    else
+      free(vector);
+  }
+
+  if(flags){
+    b->current-=flags->words*FLAG_PLANES*sizeof(u_int64_t);
+    if(flags->size==b->samples && b->nflags<b->alloc)
+      b->flags[b->nflags++]=flags;
+    else
+      flags_free(flags);
+  }
+}
+
+/* frees the spares; buffers handed out stay valid */
+void c_buffer_drain(cdrom_paranoia *p){
+  buffer_pool *b=&p->buffers;
+
+  while(b->nvectors)free(b->vectors[--b->nvectors]);
+  while(b->nflags)flags_free(b->flags[--b->nflags]);
+}
+
 /* alloc a c_block not on a cache list */
 c_block *c_alloc(int16_t *vector,long begin,long size){
   c_block *c=calloc(1,sizeof(c_block));
@@ -221,15 +435,48 @@ void c_set(c_block *v,long begin){
   v->begin=begin;
 }
 
+/* The verified root is appended to at the tail and trimmed at the
+   head for every sector returned, so a c_block's vector lives in a
+   larger buffer: trimming the head just advances vector, and the
+   tail has spare room to grow into.  When the tail runs out of room,
+   the live samples are moved back to the start of the buffer if the
+   trimmed head is at least as large as they are (so every sample
+   moved paid for one trimmed), and otherwise the buffer doubles.
+   Either way, appends and trims cost time in proportion to the
+   samples added or removed, not to the size of the block, and the
+   vector stays contiguous.
+
+   c_room() makes room for (size) samples at v->vector; the first
+   cs(v) of them keep their values, but may have moved. */
+static void c_room(c_block *v,long size){
+  long head;
+
+  if(!v->buffer){
+    v->buffer=v->vector;
+    v->alloc=cs(v);
+  }
+  head=v->vector-v->buffer;
+  if(head+size<=v->alloc)return;
+
+  if(head>=cs(v) && size<=v->alloc){
+    memmove(v->buffer,v->vector,cs(v)*sizeof(int16_t));
+  }else{
+    long alloc=max(size,v->alloc*2);
+    int16_t *buffer=malloc(alloc*sizeof(int16_t));
+    if(cs(v))memcpy(buffer,v->vector,cs(v)*sizeof(int16_t));
+    if(v->buffer)free(v->buffer);
+    v->buffer=buffer;
+    v->alloc=alloc;
+  }
+  v->vector=v->buffer;
+}
+
 /* pos here is vector position from zero */
 void c_insert(c_block *v,long pos,int16_t *b,long size){
   int vs=cs(v);
   if(pos<0 || pos>vs)return;
 
-  if(v->vector)
-    v->vector=realloc(v->vector,sizeof(int16_t)*(size+vs));
-  else
-    v->vector=malloc(sizeof(int16_t)*size);
+  c_room(v,vs+size);
   
   if(pos<vs)memmove(v->vector+pos+size,v->vector+pos,
 		       (vs-pos)*sizeof(int16_t));
@@ -245,8 +492,16 @@ void c_remove(c_block *v,long cutpos,long cutsize){
   if(cutsize<0)cutsize=vs-cutpos;
   if(cutsize<1)return;
 
-  memmove(v->vector+cutpos,v->vector+cutpos+cutsize,
-            (vs-cutpos-cutsize)*sizeof(int16_t));
+  if(cutpos==0){
+    /* trimming the head; see c_room() */
+    if(!v->buffer){
+      v->buffer=v->vector;
+      v->alloc=vs;
+    }
+    v->vector+=cutsize;
+  }else
+    memmove(v->vector+cutpos,v->vector+cutpos+cutsize,
+	    (vs-cutpos-cutsize)*sizeof(int16_t));
   
   v->size-=cutsize;
 }
@@ -264,10 +519,7 @@ void c_append(c_block *v, int16_t *vector, long size){
   int vs=cs(v);
 
   /* update the vector */
-  if(v->vector)
-    v->vector=realloc(v->vector,sizeof(int16_t)*(size+vs));
-  else
-    v->vector=malloc(sizeof(int16_t)*size);
+  c_room(v,vs+size);
   memcpy(v->vector+vs,vector,sizeof(int16_t)*size);
 
   v->size+=size;
@@ -313,19 +565,26 @@ void i_paranoia_firstlast(cdrom_paranoia *p){
 cdrom_paranoia *paranoia_init(cdrom_drive *d){
   cdrom_paranoia *p=calloc(1,sizeof(cdrom_paranoia));
 
-  p->cache=new_list((void *)&i_cblock_constructor,
-		    (void *)&i_cblock_destructor);
+  i_simd_init();
 
-  p->fragments=new_list((void *)&i_vfragment_constructor,
-			(void *)&i_v_fragment_destructor);
+  /* c_blocks and v_fragments come from our own slabs by way of
+     new_c_block() and new_v_fragment(), never new_elem() */
+  p->cblocks=slab_new(sizeof(c_block));
+  p->vfragments=slab_new(sizeof(v_fragment));
+
+  p->cache=new_list(NULL,(void *)&i_cblock_destructor);
+  p->fragments=new_list(NULL,(void *)&i_v_fragment_destructor);
 
   p->cdcache_begin= 9999999;
   p->cdcache_end= 9999999;
   p->cdcache_size=CACHEMODEL_SECTORS;
-  p->sortcache=sort_alloc(p->cdcache_size*CD_FRAMEWORDS);
+  p->cdcache_backseek=1;
+  p->sortcache=sort_alloc(p->cdcache_size*CD_FRAMEWORDS,SORT_FLAT|SORT_KGRAM);
   p->d=d;
   p->dynoverlap=MAX_SECTOR_OVERLAP*CD_FRAMEWORDS;
   p->cache_limit=JIGGLE_MODULO;
+  p->probe_min=PROBE_STRIDE_MIN;
+  p->probe_max=PROBE_STRIDE_MAX;
   p->enable=PARANOIA_MODE_FULL;
   p->cursor=cdda_disc_firstsector(d);
 
@@ -338,7 +597,28 @@ cdrom_paranoia *paranoia_init(cdrom_drive *d){
 /* sectors < 0 indicates a query.  Returns the number of sectors before the call */
 int paranoia_cachemodel_size(cdrom_paranoia *p,int sectors){
   int ret = p->cdcache_size;
-  if(sectors>=0)
+  if(sectors>=0){
+    i_read_drain(p);
     p->cdcache_size=sectors;
+  }
   return ret;
 }
+
+/* Shapes the cache model after a measurement of the drive.  The size
+   also sets how much each read pass asks for, so it isn't allowed to
+   fall below what verification needs to overlap reads, nor past the
+   largest model adaptation would grow to. */
+void paranoia_cachemodel_set(cdrom_paranoia *p,int sectors,int readahead,
+			     int backseek){
+  i_read_drain(p);
+  p->cdcache_size=min(max(sectors,CACHEMODEL_MIN),CACHEMODEL_MAX);
+  p->cdcache_readahead=max(readahead,0);
+  p->cdcache_backseek=(backseek!=0);
+}
+
+void paranoia_cachemodel_adapt(cdrom_paranoia *p,int onoff){
+  i_read_drain(p);
+  p->cdcache_adapt=onoff;
+  p->cdcache_floor=CACHEMODEL_MIN;
+  p->cdcache_quiet=0;
+}
@@ -17,11 +17,34 @@
 #define JIGGLE_MODULO        15     /* sectors */
 #define MIN_SILENCE_BOUNDARY 1024   /* 16 bit words */
 #define CACHEMODEL_SECTORS   1200
+#define CACHEMODEL_MIN       (MAX_SECTOR_OVERLAP*4) /* smallest modeled cache */
+#define CACHEMODEL_MAX       (CACHEMODEL_SECTORS*2) /* largest adapted to */
+#define CACHEMODEL_QUIET     8      /* busts that seek before shrinking */
+#define PROBE_STRIDE_MIN     23     /* 16 bit words */
+#define PROBE_STRIDE_MAX     MIN_WORDS_SEARCH
+#define MEMORY_BLOCKS        8      /* c_blocks a memory limit is split into */
 
 #define min(x,y) ((x)>(y)?(y):(x))
 #define max(x,y) ((x)<(y)?(y):(x))
 
 #include "isort.h"
+#include "flags.h"
+
+/* Fixed-size objects carved out of pages, with freed objects kept on
+   a free list for reuse.  Pages are only released by slab_free(). */
+typedef struct slab{
+  long   size;          /* bytes per object */
+  long   perpage;       /* objects per page */
+  void  *free;          /* freed objects, chained through their first word */
+  void **pages;
+  long   npages;
+  long   used;          /* objects handed out from the newest page */
+} slab;
+
+extern slab *slab_new(long size);
+extern void *slab_get(slab *s); /* zeroed */
+extern void slab_put(slab *s,void *obj);
+extern void slab_free(slab *s);
 
 typedef struct linked_list{
   /* linked list */
@@ -33,6 +56,8 @@ typedef struct linked_list{
   long current;
   long active;
 
+  slab *nodes;          /* the linked_elements */
+
 } linked_list;
 
 typedef struct linked_element{
@@ -47,6 +72,8 @@ typedef struct linked_element{
 extern linked_list *new_list(void *(*new)(void),void (*free)(void *));
 extern linked_element *new_elem(linked_list *list);
 extern linked_element *add_elem(linked_list *list,void *elem);
+extern linked_element *insert_elem(linked_list *list,linked_element *after,
+				   void *elem);
 extern void free_list(linked_list *list,int free_ptr); /* unlink or free */
 extern void free_elem(linked_element *e,int free_ptr); /* unlink or free */
 extern void *get_elem(linked_element *e);
@@ -59,16 +86,18 @@ typedef struct c_block{
   long begin;
   long size;
 
+  /* Once a c_block is grown or trimmed (c_append() and friends),
+     vector is a window into a larger allocation; see c_room() */
+  int16_t *buffer;      /* the allocation, or NULL if it's vector */
+  long alloc;           /* samples allocated at buffer (or, for cache
+			   c_blocks, at vector) */
+
   /* auxiliary support structures */
-  unsigned char *flags; /* 1    known boundaries in read data
-			   2    known blanked data
-			   4    matched sample
-			   8    reserved
-			   16   reserved
-			   32   reserved
-			   64   reserved
-			   128  reserved
-			 */
+  flag_planes *flags;   /* one bit plane each for
+			   FLAGS_EDGE      known boundaries in read data
+			   FLAGS_UNREAD    known blanked data
+			   FLAGS_VERIFIED  matched sample
+			   (see flags.h) */
 
   /* end of session cases */
   long lastsector;
@@ -133,6 +162,48 @@ typedef struct offsets{
 
 } offsets;
 
+/* Spare c_block storage, so that each read pass reuses the audio
+   buffers and flags of the c_blocks it retires (see c_buffer_get()) */
+typedef struct buffer_pool{
+  long          samples;    /* per buffer; set by the first c_buffer_get() */
+  int16_t     **vectors;    /* spare audio buffers */
+  int           nvectors;
+  flag_planes **flags;      /* spare flags */
+  int           nflags;
+  int           alloc;      /* slots in each spare list */
+
+  long          current;    /* bytes handed out and not yet returned */
+  long          peak;
+} buffer_pool;
+
+/* One c_block's worth of reading; see i_read_c_block().  The caller
+   lays it out, the reads themselves may happen on the reader thread,
+   and the caller turns the result into a c_block. */
+typedef struct read_job{
+  struct cdrom_paranoia *p;
+  long readat;          /* first sector */
+  long dyndrift;        /* p->dyndrift it allowed for */
+  long totaltoread;     /* sectors */
+  long firstsector;     /* readable span, as of laying out */
+  long lastsector;
+  int16_t *buffer;
+  flag_planes *flags;
+
+  /* results */
+  long firstread;
+  long sofar;
+  int anyflag;
+  int lastflag;         /* reached the end of the readable span */
+  int nomedium;
+
+  /* progress callbacks; if (callback) is NULL they're saved in
+     (events), position/function pairs, for the caller to make */
+  void (*callback)(long,int);
+  long *events;
+  int nevents;
+  int maxevents;
+} read_job;
+
 typedef struct cdrom_paranoia{
   cdrom_drive *d;
 
@@ -141,11 +212,24 @@ typedef struct cdrom_paranoia{
   long cache_limit;
   linked_list *fragments; /* fragments of blocks that have been 'verified' */
   sort_info *sortcache;
+  slab *cblocks;          /* cache c_blocks (new_c_block()) */
+  slab *vfragments;       /* v_fragments (new_v_fragment()) */
+  struct job_pool *pool;  /* threaded stage 1 (paranoia_threadset()) */
+  buffer_pool buffers;    /* c_block storage */
+  struct job_task *reader; /* prefetching reads (paranoia_prefetchset()) */
+  read_job ahead;         /* a read the reader is on, or has done early */
+  int ahead_pending;      /* ahead holds a read */
+  int ahead_done;         /* ...and the reader is finished with it */
 
   /* cache tracking */
   int cdcache_size;
   int cdcache_begin;
   int cdcache_end;
+  int cdcache_readahead;  /* sectors the drive reads past each request */
+  int cdcache_backseek;   /* a backward seek empties the cache */
+  int cdcache_adapt;      /* adapt the model to bust timings */
+  int cdcache_floor;      /* sizes below this have been too small */
+  int cdcache_quiet;      /* busts in a row that seeked */
   int jitter;           
 
   int enable;
@@ -160,10 +244,24 @@ typedef struct cdrom_paranoia{
   long dynoverlap;
   long dyndrift;
 
+  long memory_limit;    /* bytes; 0 for none (paranoia_memoryset()) */
+
+  /* stage 1 probe stride (paranoia_probeset()) */
+  int probe_min;
+  int probe_max;
+
   /* statistics for verification */
+  long probes;          /* stage 1 probes tried */
+  long probe_hits;      /* ...and how many found a matching run */
 
 } cdrom_paranoia;
 
+extern int16_t *c_buffer_get(cdrom_paranoia *p,long samples,
+			     flag_planes **flags);
+extern void c_buffer_put(cdrom_paranoia *p,int16_t *vector,long samples,
+			 flag_planes *flags);
+extern void c_buffer_drain(cdrom_paranoia *p);
+
 extern c_block *c_alloc(int16_t *vector,long begin,long size);
 extern void c_set(c_block *v,long begin);
 extern void c_insert(c_block *v,long pos,int16_t *b,long size);
@@ -179,6 +277,9 @@ extern void c_removef(c_block *v, long cut);
 /* pos here is vector position from zero */
 
 extern void recover_cache(cdrom_paranoia *p);
+extern long i_paranoia_memory(cdrom_paranoia *p);
+extern int recover_memory(cdrom_paranoia *p,long need);
+extern void i_read_drain(cdrom_paranoia *p);
 extern void i_paranoia_firstlast(cdrom_paranoia *p);
 
 #define cv(c) (c->vector)
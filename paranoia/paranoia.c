@@ -82,6 +82,8 @@
 #include "overlap.h"
 #include "gap.h"
 #include "isort.h"
+#include "simd.h"
+#include "pool.h"
 #include <errno.h>
 
 #define MIN_SEEK_MS 6
@@ -118,16 +120,13 @@ static inline int16_t *rv(root_block *root){
     Imagine the below enumeration values are #defines to be used in a
     bitmask rather than distinct values of an enum.
 
-    The variable part of the declaration is trickery to force the enum
-    symbol values to be recorded in debug symbol tables. They are used
-    to allow one refer to the enumeration value names in a debugger
-    and in debugger expressions.
+    The values are declared in flags.h, next to the bit planes that
+    hold them.  The variable declared here is trickery to force the
+    enum symbol values to be recorded in debug symbol tables. They are
+    used to allow one refer to the enumeration value names in a
+    debugger and in debugger expressions.
 */
-enum  {
-  FLAGS_EDGE    =0x1, /**< first/last N words of frame */
-  FLAGS_UNREAD  =0x2, /**< unread, hence missing and unmatchable */
-  FLAGS_VERIFIED=0x4  /**< block read and verified */
-} paranoia_read_flags;
+enum paranoia_flags paranoia_read_flags;
 
 /**** matching and analysis code *****************************************/
 
@@ -149,18 +148,18 @@ static inline long i_paranoia_overlap(int16_t *buffA,int16_t *buffB,
 			       long offsetA, long offsetB,
 			       long sizeA,long sizeB,
 			       long *ret_begin, long *ret_end){
-  long beginA=offsetA,endA=offsetA;
-  long beginB=offsetB,endB=offsetB;
-
-  /* Scan backward to extend the matching run in that direction. */
-  for(;beginA>=0 && beginB>=0;beginA--,beginB--)
-    if(buffA[beginA]!=buffB[beginB])break;
-  beginA++;
-  beginB++;
+  long beginA,endA;
+
+  /* Scan backward to extend the matching run in that direction.  The
+   * kernels in simd.c do the comparing; they return how many samples
+   * agree, starting from (and including) the offsets.
+   */
+  beginA=offsetA-i_match_r(buffA+offsetA,buffB+offsetB,
+			   min(offsetA,offsetB)+1)+1;
   
   /* Scan forward to extend the matching run in that direction. */
-  for(;endA<sizeA && endB<sizeB;endA++,endB++)
-    if(buffA[endA]!=buffB[endB])break;
+  endA=offsetA+i_match_f(buffA+offsetA,buffB+offsetB,
+			 min(sizeA-offsetA,sizeB-offsetB));
   
   /* Return the result of our search. */
   if(ret_begin)*ret_begin=beginA;
@@ -186,51 +185,62 @@ static inline long i_paranoia_overlap(int16_t *buffA,int16_t *buffB,
  * offsets of the first and last matching samples in A.
  */
 static inline long i_paranoia_overlap2(int16_t *buffA,int16_t *buffB,
-				       unsigned char *flagsA,
-				       unsigned char *flagsB,
+				       flag_planes *flagsA,
+				       flag_planes *flagsB,
 				       long offsetA, long offsetB,
 				       long sizeA,long sizeB,
 				       long *ret_begin, long *ret_end){
-  long beginA=offsetA,endA=offsetA;
-  long beginB=offsetB,endB=offsetB;
+  long beginA,endA,k,n;
   
-  /* Scan backward to extend the matching run in that direction. */
-  for(;beginA>=0 && beginB>=0;beginA--,beginB--){
-    if(buffA[beginA]!=buffB[beginB])break;
-
+  /* Scan backward to extend the matching run in that direction.  The
+   * run stops on the first sample that mismatches, is flagged as an
+   * edge in both reads, or is flagged unread in either; which of
+   * those it was decides whether that sample belongs to the run.  The
+   * samples are compared first, then the flag planes are checked
+   * over the stretch that matched.
+   */
+  n=min(offsetA,offsetB)+1;
+  k=i_match_r(buffA+offsetA,buffB+offsetB,n);
+  k=flags_stop_r(flagsA,offsetA,flagsB,offsetB,k);
+  beginA=offsetA-k;
+  if(k==n || buffA[beginA]!=buffB[offsetB-k]){
+    /* ran off the front of a vector, or mismatch */
+    beginA++;
+  }else{
     /* don't allow matching across matching sector boundaries. The
        liklihood of the drive skipping identically in two
        different reads with the same sector read boundary is actually
        relatively very high compared to the liklihood of it skipping
        when one read is continuous across the boundary and other was
        discontinuous */
-    /* Stop if both samples were at the edges of a low-level read. */
-    if((flagsA[beginA]&flagsB[beginB]&FLAGS_EDGE)){
-      beginA--;
-      beginB--;
-      break;
-    }
-
-    /* don't allow matching through known missing data */
-    if((flagsA[beginA]&FLAGS_UNREAD)|| (flagsB[beginB]&FLAGS_UNREAD))break;
+    /* If both samples were at the edges of a low-level read, keep
+       the edge sample and stop.  Otherwise we stopped on known
+       missing data, which we don't allow matching through. */
+    if((flags_test(flagsA,beginA,FLAGS_EDGE)&
+	flags_test(flagsB,offsetB-k,FLAGS_EDGE))==0)
+      beginA++;
   }
-  beginA++;
-  beginB++;
   
-  /* Scan forward to extend the matching run in that direction. */
-  for(;endA<sizeA && endB<sizeB;endA++,endB++){
-    if(buffA[endA]!=buffB[endB])break;
-
-    /* don't allow matching across matching sector boundaries */
-    /* Stop if both samples were at the edges of a low-level read.
-     */
-    if((flagsA[endA]&flagsB[endB]&FLAGS_EDGE) &&endA!=beginA){
-      break;
+  /* Scan forward to extend the matching run in that direction.
+   *
+   * The edge test doesn't stop a run that would otherwise be empty
+   * (when the backward scan stopped on the starting sample), so deal
+   * with that sample here and let the kernel take the rest.
+   */
+  endA=offsetA;
+  n=min(sizeA-offsetA,sizeB-offsetB);
+  if(beginA==offsetA && n>0){
+    if(buffA[offsetA]!=buffB[offsetB] ||
+       flags_test(flagsA,offsetA,FLAGS_UNREAD) ||
+       flags_test(flagsB,offsetB,FLAGS_UNREAD))
+      n=0;
+    else{
+      endA++;
+      n--;
     }
-
-    /* don't allow matching through known missing data */
-    if((flagsA[endA]&FLAGS_UNREAD)||(flagsB[endB]&FLAGS_UNREAD))break;
   }
+  k=i_match_f(buffA+endA,buffB+offsetB+endA-offsetA,n);
+  endA+=flags_stop_f(flagsA,endA,flagsB,offsetB+endA-offsetA,k);
 
   /* Return the result of our search. */
   if(ret_begin)*ret_begin=beginA;
@@ -257,10 +267,10 @@ static inline long i_paranoia_overlap2(int16_t *buffA,int16_t *buffB,
  */
 static inline long do_const_sync(c_block *A,
 				 sort_info *B,
-				 unsigned char *flagB,
+				 flag_planes *flagB,
 				 long posA,long posB,
 				 long *begin,long *end,long *offset){
-  unsigned char *flagA=A->flags;
+  flag_planes *flagA=A->flags;
   long ret=0;
 
   /* If we're doing any verification whatsoever, we have flags in stage
@@ -272,7 +282,7 @@ static inline long do_const_sync(c_block *A,
     ret=i_paranoia_overlap(cv(A),iv(B),posA,posB,
 			   cs(A),is(B),begin,end);
   else
-    if((flagB[posB]&FLAGS_UNREAD)==0)
+    if(!flags_test(flagB,posB,FLAGS_UNREAD))
       ret=i_paranoia_overlap2(cv(A),iv(B),flagA,flagB,posA,posB,cs(A),
 			      is(B),begin,end);
 	
@@ -315,7 +325,12 @@ static inline long do_const_sync(c_block *A,
  * (offset) is set to the difference in position of the run in A and B.
  * (begin) and (end) are the absolute positions of the samples in
  * B.  (offset) transforms A to B's frame of reference.  I.e., an offset of
- * 2 would mean that A's absolute 3 is equivalent to B's 5.
+ * 2 would mean that A's absolute 3 is equivalent to B's 5.  Adding
+ * (offset) to the jitter statistics is up to the caller.
+ *
+ * Nothing here writes to (p) or to the index behind (A) beyond A's
+ * search state, so stage 1 can run several of these at once on
+ * private copies of the sort_info.
  */
 
 /* post is w.r.t. B.  in stage one, we post from old.  In stage 2 we
@@ -323,17 +338,18 @@ static inline long do_const_sync(c_block *A,
    reference */
 
 static inline long try_sort_sync(cdrom_paranoia *p,
-				 sort_info *A,unsigned char *Aflags,
+				 sort_info *A,flag_planes *Aflags,
 				 c_block *B,
 				 long post,long *begin,long *end,
-				 long *offset,void (*callback)(long,int)){
+				 long *offset){
   
   long dynoverlap=p->dynoverlap;
-  sort_link *ptr=NULL;
-  unsigned char *Bflags=B->flags;
+  long ptr=-1;
+  long shift=-1;
+  flag_planes *Bflags=B->flags;
 
   /* block flag matches FLAGS_UNREAD (and hence unmatchable) */
-  if(Bflags==NULL || (Bflags[post-cb(B)]&FLAGS_UNREAD)==0){
+  if(Bflags==NULL || !flags_test(Bflags,post-cb(B),FLAGS_UNREAD)){
     /* always try absolute offset zero first! */
     {
       long zeropos=post-ib(A);
@@ -353,12 +369,8 @@ static inline long try_sort_sync(cdrom_paranoia *p,
 	   */
 	  if(do_const_sync(B,A,Aflags,
 			   post-cb(B),zeropos,
-			   begin,end,offset)){
-	    
-	    offset_add_value(p,&(p->stage1),*offset,callback);
-	    
+			   begin,end,offset))
 	    return(1);
-	  }
 	}
       }
     }
@@ -370,28 +382,41 @@ static inline long try_sort_sync(cdrom_paranoia *p,
    * to each other.  Now we search through A for samples that do have
    * the same value as B's post.  The search looks from first to last
    * occurrence witin (dynoverlap) samples of (post).
+   *
+   * If the index can search on grams (runs of SORT_GRAM samples), we
+   * search for the gram at (post) instead.  A single sample value
+   * recurs constantly in quiet audio, and each bogus hit costs a run
+   * extension to reject; a gram almost never recurs by accident.  At
+   * the end of B, where no gram starts at (post), we use the one that
+   * ends there and (shift) the hits back onto (post).
    */
-  ptr=sort_getmatch(A,post-ib(A),dynoverlap,cv(B)[post-cb(B)]);
+  if(A->grams && cs(B)>=SORT_GRAM){
+    shift=(post-cb(B)+SORT_GRAM>cs(B) ? SORT_GRAM-1 : 0);
+    ptr=sort_getgram(A,post-ib(A)-shift,dynoverlap,cv(B)+post-cb(B)-shift);
+    if(ptr!=-1)ptr+=shift;
+  }else
+    ptr=sort_getmatch(A,post-ib(A),dynoverlap,cv(B)[post-cb(B)]);
   
-  while(ptr){
+  while(ptr!=-1){
     
     /* We've found a matching sample, so try to grow the matching run in
      * both directions.  If we find a long enough run (longer than
      * MIN_WORDS_SEARCH), we've found a match.
      */
     if(do_const_sync(B,A,Aflags,
-		     post-cb(B),ipos(A,ptr),
-		     begin,end,offset)){
-
-      offset_add_value(p,&(p->stage1),*offset,callback);
+		     post-cb(B),ptr,
+		     begin,end,offset))
       return(1);
-    }
 
     /* The matching sample was just a fluke -- there weren't enough adjacent
      * samples that matched to consider a matching run.  So now we check
      * for the next occurrence of that value in A.
      */
-    ptr=sort_nextmatch(A,ptr);
+    if(shift>=0){
+      ptr=sort_nextgram(A);
+      if(ptr!=-1)ptr+=shift;
+    }else
+      ptr=sort_nextmatch(A,ptr);
   }
   
   /* We didn't find any matches. */
@@ -418,33 +443,21 @@ afterward. */
 
 
 /* ===========================================================================
- * stage1_matched() (internal)
- *
- * This function is called whenever stage 1 verification finds two identical
- * runs of samples from different reads.  The runs must be more than
- * MIN_WORDS_SEARCH samples long.  They may be jittered (i.e. their absolute
- * positions on the CD may not match due to inaccurate seeking) with respect
- * to each other, but they have been verified to have no dropped samples
- * within them.
- *
- * This function provides feedback via the callback mechanism and marks the
- * runs as verified.  The details of the marking are somehwat subtle and
- * are described near the relevant code.
+ * stage1_report() (internal)
  *
- * Subsequent portions of the stage 1 code will build a verified fragment
- * from this run.  The verified fragment will eventually be merged
- * into the verified root (and its absolute position determined) in
- * stage 2.
+ * Provides the callback feedback for a stage 1 match (see
+ * stage1_matched()).  It is split out so that threaded stage 1 can
+ * report its matches afterward, in order, from the calling thread.
+ * (newflags) are the new c_block's flags.
  */
-static inline void stage1_matched(c_block *old,c_block *new,
+static inline void stage1_report(c_block *old,c_block *new,
+				 flag_planes *newflags,
 				 long matchbegin,long matchend,
 				 long matchoffset,void (*callback)(long,int)){
-  long i;
   long oldadjbegin=matchbegin-cb(old);
   long oldadjend=matchend-cb(old);
   long newadjbegin=matchbegin-matchoffset-cb(new);
   long newadjend=matchend-matchoffset-cb(new);
-  
 
   /* Provide feedback via the callback about the samples we've just
    * verified.
@@ -460,22 +473,54 @@ static inline void stage1_matched(c_block *old,c_block *new,
    */
   if(matchbegin-matchoffset<=cb(new) ||
      matchbegin<=cb(old) ||
-     (new->flags[newadjbegin]&FLAGS_EDGE) ||
-     (old->flags[oldadjbegin]&FLAGS_EDGE)){
+     flags_test(newflags,newadjbegin,FLAGS_EDGE) ||
+     flags_test(old->flags,oldadjbegin,FLAGS_EDGE)){
     if(matchoffset)
       if(callback)(*callback)(matchbegin,PARANOIA_CB_FIXUP_EDGE);
   }else
     if(callback)(*callback)(matchbegin,PARANOIA_CB_FIXUP_ATOM);
   
   if(matchend-matchoffset>=ce(new) ||
-     (new->flags[newadjend]&FLAGS_EDGE) ||
+     flags_test(newflags,newadjend,FLAGS_EDGE) ||
      matchend>=ce(old) ||
-     (old->flags[oldadjend]&FLAGS_EDGE)){
+     flags_test(old->flags,oldadjend,FLAGS_EDGE)){
     if(matchoffset)
       if(callback)(*callback)(matchend,PARANOIA_CB_FIXUP_EDGE);
   }else
     if(callback)(*callback)(matchend,PARANOIA_CB_FIXUP_ATOM);
-  
+}
+
+/* ===========================================================================
+ * stage1_matched() (internal)
+ *
+ * This function is called whenever stage 1 verification finds two identical
+ * runs of samples from different reads.  The runs must be more than
+ * MIN_WORDS_SEARCH samples long.  They may be jittered (i.e. their absolute
+ * positions on the CD may not match due to inaccurate seeking) with respect
+ * to each other, but they have been verified to have no dropped samples
+ * within them.
+ *
+ * This function provides feedback via the callback mechanism and marks the
+ * runs as verified.  The details of the marking are somehwat subtle and
+ * are described near the relevant code.  The new c_block's marks go in
+ * (newflags), normally new->flags.
+ *
+ * Subsequent portions of the stage 1 code will build a verified fragment
+ * from this run.  The verified fragment will eventually be merged
+ * into the verified root (and its absolute position determined) in
+ * stage 2.
+ */
+static inline void stage1_matched(c_block *old,c_block *new,
+				 flag_planes *newflags,
+				 long matchbegin,long matchend,
+				 long matchoffset,void (*callback)(long,int)){
+  long oldadjbegin=matchbegin-cb(old);
+  long oldadjend=matchend-cb(old);
+  long newadjbegin=matchbegin-matchoffset-cb(new);
+  long newadjend=matchend-matchoffset-cb(new);
+
+  if(callback)
+    stage1_report(old,new,newflags,matchbegin,matchend,matchoffset,callback);
 
   /* Mark verified samples as "verified," but trim the verified region
    * by OVERLAP_ADJ samples on each side.  There are several significant
@@ -527,19 +572,50 @@ static inline void stage1_matched(c_block *old,c_block *new,
      remove elements from the sort such that later sorts do
      not have to sift through already matched data */
   
-  newadjbegin+=OVERLAP_ADJ;
-  newadjend-=OVERLAP_ADJ;
-  for(i=newadjbegin;i<newadjend;i++)
-    new->flags[i]|=FLAGS_VERIFIED; /* mark verified */
-
-  oldadjbegin+=OVERLAP_ADJ;
-  oldadjend-=OVERLAP_ADJ;
-  for(i=oldadjbegin;i<oldadjend;i++)
-    old->flags[i]|=FLAGS_VERIFIED; /* mark verified */
+  flags_set(newflags,newadjbegin+OVERLAP_ADJ,newadjend-OVERLAP_ADJ,
+	    FLAGS_VERIFIED); /* mark verified */
+  flags_set(old->flags,oldadjbegin+OVERLAP_ADJ,oldadjend-OVERLAP_ADJ,
+	    FLAGS_VERIFIED);
     
 }
 
 
+/* ===========================================================================
+ * stage1_log (internal)
+ *
+ * The matches one old c_block produced in threaded stage 1, in the
+ * order they were found.
+ */
+
+typedef struct stage1_match{
+  long begin;           /* relative to the old c_block, in case stage 2 */
+  long end;             /* drift moves the c_blocks before we replay */
+  long offset;
+  int  quiet;           /* nothing but silence; don't use the callback */
+} stage1_match;
+
+typedef struct stage1_log{
+  stage1_match *matches;
+  long          count;
+  long          alloc;
+
+  long          probes;  /* probe counters, for p->probes/probe_hits */
+  long          hits;
+} stage1_log;
+
+static void stage1_log_add(stage1_log *log,long begin,long end,
+			   long offset,int quiet){
+  if(log->count>=log->alloc){
+    log->alloc=(log->alloc?log->alloc*2:16);
+    log->matches=realloc(log->matches,log->alloc*sizeof(stage1_match));
+  }
+  log->matches[log->count].begin=begin;
+  log->matches[log->count].end=end;
+  log->matches[log->count].offset=offset;
+  log->matches[log->count].quiet=quiet;
+  log->count++;
+}
+
 /* ===========================================================================
  * i_iterate_stage1 (internal)
  *
@@ -562,8 +638,27 @@ static inline void stage1_matched(c_block *old,c_block *new,
  *
  * This function returns the number of distinct runs verified in the new
  * c_block when compared against this old c_block.
+ *
+ * The probes are spaced adaptively, between p->probe_min and
+ * p->probe_max samples apart.  Samples that are already verified or
+ * are unread can't start a match, so whole stretches of them are
+ * stepped over a word of flags at a time.  Each probe that finds
+ * nothing widens the stride (a run of more than MIN_WORDS_SEARCH
+ * samples can't fall between two probes as long as probe_max doesn't
+ * exceed MIN_WORDS_SEARCH), and the stride drops back to probe_min
+ * after a match and after every skip, since the next run most likely
+ * begins just past a rift or a gap in the data.
+ *
+ * Threaded stage 1 runs this on several old c_blocks at once, each with
+ * its own copy of the index's search state (i), its own copy of the new
+ * c_block's flags (newflags) and a (log).  Matches are then only marked,
+ * not reported or added to the jitter statistics; they are appended to
+ * the log so that i_stage1() can do that afterward, in order.  With no
+ * log, matches are reported as they're found.
  */
-static long i_iterate_stage1(cdrom_paranoia *p,c_block *old,c_block *new,
+static long i_iterate_stage1(cdrom_paranoia *p,sort_info *i,
+			     c_block *old,c_block *new,
+			     flag_planes *newflags,stage1_log *log,
 			     void(*callback)(long,int)){
 
   long matchbegin=-1,matchend=-1,matchoffset;
@@ -584,64 +679,96 @@ static long i_iterate_stage1(cdrom_paranoia *p,c_block *old,c_block *new,
   long searchend=min(ce(old),ce(new));
   long searchbegin=max(cb(old),cb(new));
   long searchsize=searchend-searchbegin;
-  sort_info *i=p->sortcache;
   long ret=0;
   long j;
+  long stride=p->probe_min;
 
-  long tried=0,matched=0;
+  long tried=0,hits=0,matched=0;
 
   if(searchsize<=0)return(0);
   
   /* match return values are in terms of the new vector, not old */
-  /* "???: Why 23?" Odd, prime number --Monty  */
+  /* "???: Why 23?" Odd, prime number --Monty
+     (23 remains the default minimum stride) */
 
-  for(j=searchbegin;j<searchend;j+=23){
+  j=searchbegin;
+  while(j<searchend){
 
     /* Skip past any samples verified in previous comparisons to
      * other old c_blocks.  Also, obviously, don't bother verifying
      * unread/unmatchable samples.
      */
-    if((new->flags[j-cb(new)]&(FLAGS_VERIFIED|FLAGS_UNREAD))==0){      
-      tried++;
+    {
+      long pos=j-cb(new),end=searchend-cb(new),next;
+      do{
+	next=flags_next(newflags,pos,end,FLAGS_VERIFIED,0);
+	pos=flags_next(newflags,next,end,FLAGS_UNREAD,0);
+      }while(pos!=next);
+      if(pos+cb(new)!=j){
+	j=pos+cb(new);
+	stride=p->probe_min;
+	if(j>=searchend)break;
+      }
+    }
 
-      /* Starting from the sample in the old c_block with the absolute
-       * position j, look for a matching run in the new c_block.  This
-       * search will look a certain distance around j, and if successful
-       * will extend the matching run as far backward and forward as
-       * it can.
-       *
-       * The search will only return 1 if it finds a matching run long
-       * enough to be deemed significant.
-       */
-      if(try_sort_sync(p,i,new->flags,old,j,&matchbegin,&matchend,&matchoffset,
-		       callback)==1){
-	
-	matched+=matchend-matchbegin;
-
-	/* purely cosmetic: if we're matching zeros, don't use the
-           callback because they will appear to be all skewed */
-	{
-	  long j=matchbegin-cb(old);
-	  long end=matchend-cb(old);
-	  for(;j<end;j++)if(cv(old)[j]!=0)break;
-
-	  /* Mark the matched samples in both c_blocks as verified.
-	   * In reality, not all the samples are marked.  See
-	   * stage1_matched() for details.
-	   */
-	  if(j<end){
-	    stage1_matched(old,new,matchbegin,matchend,matchoffset,callback);
-	  }else{
-	    stage1_matched(old,new,matchbegin,matchend,matchoffset,NULL);
-	  }
-	}
-	ret++;
+    tried++;
+
+    /* Starting from the sample in the old c_block with the absolute
+     * position j, look for a matching run in the new c_block.  This
+     * search will look a certain distance around j, and if successful
+     * will extend the matching run as far backward and forward as
+     * it can.
+     *
+     * The search will only return 1 if it finds a matching run long
+     * enough to be deemed significant.
+     */
+    if(try_sort_sync(p,i,newflags,old,j,&matchbegin,&matchend,
+		     &matchoffset)==1){
+      int quiet;
+
+      matched+=matchend-matchbegin;
 
-	/* Skip past this verified run to look for more matches. */
-	if(matchend-1>j)j=matchend-1;
+      /* purely cosmetic: if we're matching zeros, don't use the
+	 callback because they will appear to be all skewed */
+      {
+	long j=matchbegin-cb(old);
+	long end=matchend-cb(old);
+	for(;j<end;j++)if(cv(old)[j]!=0)break;
+	quiet=(j>=end);
       }
-    }
-  } /* end for */
+
+      /* Mark the matched samples in both c_blocks as verified.
+       * In reality, not all the samples are marked.  See
+       * stage1_matched() for details.
+       */
+      if(log){
+	stage1_log_add(log,matchbegin-cb(old),matchend-cb(old),matchoffset,
+		       quiet);
+	stage1_matched(old,new,newflags,matchbegin,matchend,matchoffset,
+		       NULL);
+      }else{
+	offset_add_value(p,&(p->stage1),matchoffset,callback);
+	stage1_matched(old,new,newflags,matchbegin,matchend,matchoffset,
+		       quiet?NULL:callback);
+      }
+      ret++;
+      hits++;
+
+      /* Skip past this verified run to look for more matches. */
+      if(matchend-1>j)j=matchend-1;
+      stride=p->probe_min;
+    }else
+      stride=min(stride*2,p->probe_max);
+    j+=stride;
+  } /* end while */
+
+  if(log){
+    log->probes+=tried;
+    log->hits+=hits;
+  }else{
+    p->probes+=tried;
+    p->probe_hits+=hits;
+  }
 
 #ifdef NOISY 
   fprintf(stderr,"iterate_stage1: search area=%ld[%ld-%ld] tried=%ld matched=%ld spans=%ld\n",
@@ -652,6 +779,100 @@ static long i_iterate_stage1(cdrom_paranoia *p,c_block *old,c_block *new,
 }
 
 
+/* ===========================================================================
+ * i_stage1_threaded() (internal)
+ *
+ * Threaded version of i_stage1()'s loop over the older c_blocks.  Each
+ * old c_block that overlaps the new one becomes a job in p->pool.  The
+ * index on the new c_block is built up front and is only read while
+ * the jobs run; each job searches it with a private copy of its search
+ * state, and marks a private copy of the new c_block's flags.  Nothing
+ * else is shared, since no two jobs touch the same old c_block.
+ *
+ * Once all jobs are done we walk the c_blocks in the same order as the
+ * unthreaded loop and, for each, make the callbacks, feed the jitter
+ * statistics and merge its FLAGS_VERIFIED marks into the new c_block.
+ * The outcome therefore depends only on the data, never on how the
+ * jobs were scheduled.  It isn't quite the unthreaded outcome, though:
+ * every job sees the new c_block's flags as they were before stage 1
+ * and (dynoverlap) as it was before any of this round's matches, where
+ * the unthreaded loop sees the effects of the c_blocks compared before.
+ */
+
+typedef struct stage1_job{
+  c_block     *old;
+  flag_planes *flags;    /* private copy of the new c_block's flags */
+  stage1_log   log;
+} stage1_job;
+
+typedef struct stage1_batch{
+  cdrom_paranoia *p;
+  c_block        *new;
+  stage1_job     *jobs;
+} stage1_batch;
+
+static void i_stage1_job(void *ctx,long n){
+  stage1_batch *b=ctx;
+  stage1_job *job=b->jobs+n;
+  sort_info index=*b->p->sortcache;
+
+  i_iterate_stage1(b->p,&index,job->old,b->new,job->flags,&job->log,NULL);
+}
+
+static void i_stage1_threaded(cdrom_paranoia *p,c_block *new,long jobs,
+			      void(*callback)(long,int)){
+  c_block *ptr;
+  stage1_batch b;
+  long n=0,k;
+
+  b.p=p;
+  b.new=new;
+  b.jobs=calloc(jobs,sizeof(stage1_job));
+
+  for(ptr=c_last(p);ptr && ptr!=new;ptr=c_prev(ptr))
+    if(cb(ptr)<ce(new) && ce(ptr)>cb(new)){
+      b.jobs[n].old=ptr;
+      b.jobs[n].flags=flags_dup(new->flags);
+      n++;
+    }
+
+  sort_build(p->sortcache);
+  pool_run(p->pool,i_stage1_job,&b,n);
+
+  /* Replay and merge, oldest c_block first. */
+  n=0;
+  for(ptr=c_last(p);ptr && ptr!=new;ptr=c_prev(ptr)){
+    stage1_job *job=b.jobs+n;
+
+    if(callback)(*callback)(cb(new),PARANOIA_CB_VERIFY);
+    if(n>=jobs || job->old!=ptr)continue;
+
+    for(k=0;k<job->log.count;k++){
+      stage1_match *m=job->log.matches+k;
+      long begin=m->begin+cb(ptr);
+      long end=m->end+cb(ptr);
+
+      offset_add_value(p,&(p->stage1),m->offset,callback);
+
+      /* Drift correction may have moved the c_blocks unevenly near
+	 the start of the disc; don't report what no longer fits. */
+      if(!m->quiet && begin-m->offset>=cb(new) && end-m->offset<=ce(new))
+	stage1_report(ptr,new,new->flags,begin,end,m->offset,callback);
+    }
+
+    flags_or(new->flags,job->flags,FLAGS_VERIFIED);
+    p->probes+=job->log.probes;
+    p->probe_hits+=job->log.hits;
+
+    free(job->log.matches);
+    flags_free(job->flags);
+    n++;
+  }
+
+  free(b.jobs);
+}
+
+
 /* ===========================================================================
  * i_stage1() (internal)
  *
@@ -688,14 +909,38 @@ static long i_stage1(cdrom_paranoia *p,c_block *new,
   c_block *ptr=c_last(p);
   int ret=0;
   long begin=0,end;
+  long overlapping=0;
   
   /* We're going to be comparing the new c_block against the other
    * c_blocks in memory.  Initialize the "sort cache" index to allow
    * for fast searching through the new c_block.  (The index will
    * actually be built the first time we search.)
+   *
+   * Only the stretch of the new c_block that overlaps some older
+   * c_block, widened by the largest distance a search can reach, can
+   * ever be matched, so that's all we index.  A read of fresh disc
+   * overlaps the cache only at its head; a reread overlaps almost all
+   * of it.  The index can't carry over from one c_block to the next,
+   * as each c_block is a separate read whose samples may differ.
    */
-  if(ptr)sort_setup(p->sortcache,cv(new),&cb(new),cs(new),
-		    cb(new),ce(new));
+  if(ptr){
+    long spread=max(p->dynoverlap,MAX_SECTOR_OVERLAP*CD_FRAMEWORDS);
+    long sortlo=ce(new);
+    long sorthi=cb(new);
+    c_block *c=ptr;
+
+    while(c && c!=new){
+      if(cb(c)<ce(new) && ce(c)>cb(new)){
+	overlapping++;
+	sortlo=min(sortlo,max(cb(c),cb(new))-spread);
+	sorthi=max(sorthi,min(ce(c),ce(new))+spread);
+      }
+      c=c_prev(c);
+    }
+
+    if(sortlo<sorthi)
+      sort_setup(p->sortcache,cv(new),&cb(new),cs(new),sortlo,sorthi);
+  }
 
   /* Iterate from oldest to newest c_block, comparing the new c_block
    * to each, looking for a sufficiently long run of identical samples
@@ -704,14 +949,20 @@ static long i_stage1(cdrom_paranoia *p,c_block *new,
    *
    * Since the new c_block is already in the list (at the head), don't
    * compare it against itself.
+   *
+   * With a worker pool and more than one c_block to compare against,
+   * the comparisons run side by side instead.
    */
-  while(ptr && ptr!=new){
-
-    if(callback)(*callback)(cb(new),PARANOIA_CB_VERIFY);
-    i_iterate_stage1(p,ptr,new,callback);
-
-    ptr=c_prev(ptr);
-  }
+  if(p->pool && overlapping>1)
+    i_stage1_threaded(p,new,overlapping,callback);
+  else
+    while(ptr && ptr!=new){
+      
+      if(callback)(*callback)(cb(new),PARANOIA_CB_VERIFY);
+      i_iterate_stage1(p,p->sortcache,ptr,new,new->flags,NULL,callback);
+      
+      ptr=c_prev(ptr);
+    }
 
   /* parse the verified areas of new into v_fragments */
   
@@ -720,8 +971,8 @@ static long i_stage1(cdrom_paranoia *p,c_block *new,
    */
   begin=0;
   while(begin<size){
-    for(;begin<size;begin++)if(new->flags[begin]&FLAGS_VERIFIED)break;
-    for(end=begin;end<size;end++)if((new->flags[end]&FLAGS_VERIFIED)==0)break;
+    begin=flags_next(new->flags,begin,size,FLAGS_VERIFIED,1);
+    end=flags_next(new->flags,begin,size,FLAGS_VERIFIED,0);
     if(begin>=size)break;
     
     ret++;
@@ -893,7 +1144,10 @@ static long i_iterate_stage2(cdrom_paranoia *p,v_fragment *v,
        * fragments nor the root have them).
        */
       if(try_sort_sync(p,i,NULL,rc(root),j,
-		       &matchbegin,&matchend,&offset,callback)){
+		       &matchbegin,&matchend,&offset)){
+
+	/* Stage 2 matches feed the stage 1 jitter statistics too. */
+	offset_add_value(p,&(p->stage1),offset,callback);
 	
 	/* If we found a matching run, we return the results of our match.
 	 *
@@ -1864,11 +2118,6 @@ static int i_init_root(root_block *root, v_fragment *v,long begin,
     return(0);
 }
 
-static int vsort(const void *a,const void *b){
-  return((*(v_fragment **)a)->begin-(*(v_fragment **)b)->begin);
-}
-
-
 /* ===========================================================================
  * i_stage2 (internal)
  *
@@ -1915,132 +2164,111 @@ static int i_stage2(cdrom_paranoia *p,long beginword,long endword,
    * match.
    */
   while(flag){
-
-    /* Convert the linked list of verified fragments into an array,
-     * to be sorted in order of beginning sample position
-     */
-    v_fragment *first=v_first(p);
-    long active=p->fragments->active,count=0;
-    v_fragment *list[active];
-
-    while(first){
-      v_fragment *next=v_next(first);
-      list[count++]=first;
-      first=next;
-    }
+    v_fragment *first,*next;
 
     /* Reset the flag so that if we don't match any fragments, we
-     * stop looping.  Then, proceed only if there are any fragments
-     * to match.
+     * stop looping.
      */
     flag=0;
-    if(count){
-
-      /* Sort the array of verified fragments in order of beginning
-       * sample position.
-       */
-      qsort(list,active,sizeof(v_fragment *),&vsort);
       
-      /* We don't check for the silence flag yet, because even if the
-       * verified root ends in silence (and thus the silence flag is set),
-       * there may be a non-silent region at the beginning of the verified
-       * root, into which we can merge the verified fragments.
-       */
+    /* We don't check for the silence flag yet, because even if the
+     * verified root ends in silence (and thus the silence flag is set),
+     * there may be a non-silent region at the beginning of the verified
+     * root, into which we can merge the verified fragments.
+     */
 
-      /* Iterate through the verified fragments, starting at the fragment
-       * with the lowest beginning sample position.
-       */
-      for(count=0;count<active;count++){
-	first=list[count];
+    /* Iterate through the verified fragments, starting at the fragment
+     * with the lowest beginning sample position.  p->fragments is kept
+     * in that order (see new_v_fragment()), so once a fragment begins
+     * too far past the end of the root to reach it even with
+     * (dynoverlap) jitter, so does every fragment after it.  Merging a
+     * fragment frees it, so fetch the next one first.
+     */
+    for(first=v_first(p);first;first=next){
+      next=v_next(first);
 
-	/* Make sure this fragment hasn't already been merged (and
-	 * thus freed). */
-	if(first->one){
+      /* Skip fragments orphaned by drift correction. */
+      if(!first->one)continue;
 
-	  /* If we don't have a verified root yet, just promote the first
-	   * fragment (with lowest beginning sample) to be the verified
-	   * root.
-	   *
-	   * "??? It seems that this could be fairly arbitrary if jitter
-	   * is an issue.  If we've verified two fragments allegedly
-	   * beginning at "0" (which are actually slightly offset due to
-	   * jitter), the root might not begin at the earliest read
-	   * sample.  Additionally, because subsequent fragments are
-	   * only merged at the tail end of the root, this situation
-	   * won't be fixed by merging the earlier samples.
-	   *
-	   * Practically, this ends up not being critical since most
-	   * drives insert some extra silent samples at the beginning
-	   * of the stream.  Missing a few of them doesn't cause any
-	   * real lost data.  But it is non-deterministic." 
-	   *
-	   * On such a drive, the entire act of CDDA read is highly
-	   * nondeterministic.  All redbook says is +/- 75 sectors.
-	   * If you insist on the earliest possible sample, you can
-	   * get into a situation where the first read was far earlier
-	   * than all the others and no other read ever repeats the
-	   * early positioning. --Monty */
-
-	  if(rv(root)==NULL){
-	    if(i_init_root(&(p->root),first,beginword,callback)){
-	      free_v_fragment(first);
-
-	      /* Consider this a merged fragment, so set the flag
-	       * to keep looping.
-	       */
-	      flag=1;
-	      ret++;
-	    }
-	  }else{
+      /* If we don't have a verified root yet, just promote the first
+       * fragment (with lowest beginning sample) to be the verified
+       * root.
+       *
+       * "??? It seems that this could be fairly arbitrary if jitter
+       * is an issue.  If we've verified two fragments allegedly
+       * beginning at "0" (which are actually slightly offset due to
+       * jitter), the root might not begin at the earliest read
+       * sample.  Additionally, because subsequent fragments are
+       * only merged at the tail end of the root, this situation
+       * won't be fixed by merging the earlier samples.
+       *
+       * Practically, this ends up not being critical since most
+       * drives insert some extra silent samples at the beginning
+       * of the stream.  Missing a few of them doesn't cause any
+       * real lost data.  But it is non-deterministic." 
+       *
+       * On such a drive, the entire act of CDDA read is highly
+       * nondeterministic.  All redbook says is +/- 75 sectors.
+       * If you insist on the earliest possible sample, you can
+       * get into a situation where the first read was far earlier
+       * than all the others and no other read ever repeats the
+       * early positioning. --Monty */
 
-	    /* Try to merge this fragment with the verified root,
-	     * extending the tail of the root.
-	     */
-	    if(i_stage2_each(root,first,callback)){
+      if(rv(root)==NULL){
+	if(i_init_root(&(p->root),first,beginword,callback)){
+	  free_v_fragment(first);
 
-	      /* If we successfully merged the fragment, set the flag
-	       * to keep looping.
-	       */
-	      ret++;
-	      flag=1;
-	    }
-	  }
+	  /* Consider this a merged fragment, so set the flag
+	   * to keep looping.
+	   */
+	  flag=1;
+	  ret++;
 	}
-      }
+      }else{
 
-      /* If the verified root ends in a long span of silence, iterate
-       * through the remaining unmerged fragments to see if they can be
-       * merged using our special silence matching.
-       */
-      if(!flag && p->root.silenceflag){
-	for(count=0;count<active;count++){
-	  first=list[count];
-
-	  /* Make sure this fragment hasn't already been merged (and
-	   * thus freed). */
-	  if(first->one){
-	    if(rv(root)!=NULL){
-
-	      /* Try to merge the fragment into the root.  This will only
-	       * succeed if the fragment overlaps and begins with sufficient
-	       * silence to be a presumed match.
-	       *
-	       * Note that the fragments must be passed to i_silence_match()
-	       * in ascending order, as they are here.
-	       */
-	      if(i_silence_match(root,first,callback)){
+	if(fb(first)-p->dynoverlap>=re(root))break;
 
-		/* If we successfully merged the fragment, set the flag
-		 * to keep looping.
-		 */
-		ret++;
-		flag=1;
-	      }
-	    }
-	  }
-	} /* end for */
+	/* Try to merge this fragment with the verified root,
+	 * extending the tail of the root.
+	 */
+	if(i_stage2_each(root,first,callback)){
+
+	  /* If we successfully merged the fragment, set the flag
+	   * to keep looping.
+	   */
+	  ret++;
+	  flag=1;
+	}
       }
-    } /* end if(count) */
+    }
+
+    /* If the verified root ends in a long span of silence, iterate
+     * through the remaining unmerged fragments to see if they can be
+     * merged using our special silence matching.
+     */
+    if(!flag && p->root.silenceflag && rv(root)!=NULL){
+      for(first=v_first(p);first;first=next){
+	next=v_next(first);
+	if(!first->one)continue;
+	if(fb(first)-p->dynoverlap>=re(root))break;
+
+	/* Try to merge the fragment into the root.  This will only
+	 * succeed if the fragment overlaps and begins with sufficient
+	 * silence to be a presumed match.
+	 *
+	 * Note that the fragments must be passed to i_silence_match()
+	 * in ascending order, as they are here.
+	 */
+	if(i_silence_match(root,first,callback)){
+
+	  /* If we successfully merged the fragment, set the flag
+	   * to keep looping.
+	   */
+	  ret++;
+	  flag=1;
+	}
+      } /* end for */
+    }
 
     /* If we were able to extend the verified root at all during this pass
      * through the loop, loop again to see if we can merge any remaining
@@ -2121,9 +2349,10 @@ static void verify_skip_case(cdrom_paranoia *p,void(*callback)(long,int)){
       if(cbegin<=post && cend>post){
 	long vend=post;
 
-	if(c->flags[post-cbegin]&FLAGS_VERIFIED){
+	if(flags_test(c->flags,post-cbegin,FLAGS_VERIFIED)){
 	  /* verified area! */
-	  while(vend<cend && (c->flags[vend-cbegin]&FLAGS_VERIFIED))vend++;
+	  vend=cbegin+flags_next(c->flags,vend-cbegin,cend-cbegin,
+				 FLAGS_VERIFIED,0);
 	  if(!vflag || vend>vflag){
 	    graft=c;
 	    gend=vend;
@@ -2132,7 +2361,8 @@ static void verify_skip_case(cdrom_paranoia *p,void(*callback)(long,int)){
 	}else{
 	  /* not a verified area */
 	  if(!vflag){
-	    while(vend<cend && (c->flags[vend-cbegin]&FLAGS_VERIFIED)==0)vend++;
+	    vend=cbegin+flags_next(c->flags,vend-cbegin,cend-cbegin,
+				   FLAGS_VERIFIED,1);
 	    if(graft==NULL || gend>vend){
 	      /* smallest unverified area */
 	      graft=c;
@@ -2148,12 +2378,14 @@ static void verify_skip_case(cdrom_paranoia *p,void(*callback)(long,int)){
       long cbegin=cb(graft);
       long cend=ce(graft);
 
-      while(gend<cend && (graft->flags[gend-cbegin]&FLAGS_VERIFIED))gend++;
+      if(gend<cend)
+	gend=cbegin+flags_next(graft->flags,gend-cbegin,cend-cbegin,
+			       FLAGS_VERIFIED,0);
       gend=min(gend+OVERLAP_ADJ,cend);
 
       if(rv(root)==NULL){
-	int16_t *buff=malloc(cs(graft));
-	memcpy(buff,cv(graft),cs(graft));
+	int16_t *buff=malloc(cs(graft)*sizeof(int16_t));
+	memcpy(buff,cv(graft),cs(graft)*sizeof(int16_t));
 	rc(root)=c_alloc(buff,cb(graft),cs(graft));
       }else{
 	c_append(rc(root),cv(graft)+post-cbegin,
@@ -2183,14 +2415,24 @@ static void verify_skip_case(cdrom_paranoia *p,void(*callback)(long,int)){
 /**** toplevel ****************************************/
 
 void paranoia_free(cdrom_paranoia *p){
+  i_read_drain(p);
+  if(p->reader)task_free(p->reader);
+  free(p->ahead.events);
   paranoia_resetall(p);
   sort_free(p->sortcache);
+  if(p->pool)pool_free(p->pool);
   free_list(p->cache, 1);
   free_list(p->fragments, 1);
+  slab_free(p->cblocks);
+  slab_free(p->vfragments);
+  c_buffer_drain(p);
+  free(p->buffers.vectors);
+  free(p->buffers.flags);
   free(p);
 }
 
 void paranoia_modeset(cdrom_paranoia *p,int enable){
+  i_read_drain(p);
   p->enable=enable;
 }
 
@@ -2211,6 +2453,7 @@ long paranoia_seek(cdrom_paranoia *p,long seek,int mode){
   
   if(cdda_sector_gettrack(p->d,sector)==-1)return(-1);
 
+  i_read_drain(p);
   i_cblock_destructor(p->root.vector);
   p->root.vector=NULL;
   p->root.lastsector=0;
@@ -2227,15 +2470,32 @@ long paranoia_seek(cdrom_paranoia *p,long seek,int mode){
   return(ret);
 }
 
+static void read_callback(read_job *j,long pos,int function){
+  if(j->callback){
+    (*j->callback)(pos,function);
+    return;
+  }
+  if(j->nevents>=j->maxevents){
+    j->maxevents=(j->maxevents?j->maxevents*2:64);
+    j->events=realloc(j->events,j->maxevents*2*sizeof(*j->events));
+  }
+  j->events[j->nevents*2]=pos;
+  j->events[j->nevents*2+1]=function;
+  j->nevents++;
+}
+
 static void cdrom_cache_update(cdrom_paranoia *p, int lba, int sectors){
 
+  /* the drive goes on reading past what was asked for */
+  sectors+=p->cdcache_readahead;
+
   if(lba+sectors > p->cdcache_size){
     int end = lba+sectors;
     lba=end-p->cdcache_size;
     sectors = end-lba;
   }
     
-  if(lba < p->cdcache_begin){
+  if(lba < p->cdcache_begin && p->cdcache_backseek){
     /* a backseek flushes the cache */
     p->cdcache_begin=lba;
     p->cdcache_end=lba+sectors;
@@ -2252,14 +2512,54 @@ static void cdrom_cache_update(cdrom_paranoia *p, int lba, int sectors){
   }
 }
 
-static void cdrom_cache_handler(cdrom_paranoia *p, int lba, void(*callback)(long,int)){
+/* Adjusts the cache model by how long a cache bust at (seekpos) took.
+ * A bust that didn't seek (hit) found the drive holding more than the
+ * model allowed for: the model grows by half, and won't shrink below
+ * the size just shown to be too small again.  Every CACHEMODEL_QUIET
+ * busts in a row that did seek, it gives back an eighth, down toward
+ * that floor; each read pass is as large as the model, and an
+ * oversized one reads more than verification needs.
+ *
+ * Backseeks that keep hitting the cache with the model already at
+ * its largest mean the drive doesn't flush on a backseek, not that the
+ * model is small; busting switches to seeking forward, and the model
+ * starts over at CACHEMODEL_SECTORS with no floor.
+ */
+static void cdrom_cache_adapt(cdrom_paranoia *p, int seekpos, int hit){
+  if(hit){
+    p->cdcache_quiet=0;
+    if(p->cdcache_size<CACHEMODEL_MAX){
+      p->cdcache_floor=max(p->cdcache_floor,p->cdcache_size+1);
+      p->cdcache_size=min(p->cdcache_size+p->cdcache_size/2,CACHEMODEL_MAX);
+    }else if(seekpos<p->cdcache_begin && p->cdcache_backseek){
+      p->cdcache_backseek=0;
+      p->cdcache_floor=CACHEMODEL_MIN;
+      p->cdcache_size=CACHEMODEL_SECTORS;
+    }
+    return;
+  }
+
+  if(++p->cdcache_quiet>=CACHEMODEL_QUIET){
+    p->cdcache_quiet=0;
+    p->cdcache_size=max(p->cdcache_size-p->cdcache_size/8,p->cdcache_floor);
+  }
+}
+
+static void cdrom_cache_handler(cdrom_paranoia *p, int lba, read_job *j){
   int seekpos;
   int ms;
   if(lba>=p->cdcache_end)return; /* nothing to do */
 
   if(lba<0)lba=0;
 
-  if(lba<p->cdcache_begin){
+  if(!p->cdcache_backseek &&
+     lba+p->cdcache_size<=cdda_disc_lastsector(p->d)){
+    /* backseeks don't flush this drive; read far enough ahead to push
+       the cache past lba instead.  Within a cache's length of the end
+       of the disc there's no room to, and a backseek is the best we
+       can do. */
+    seekpos = lba+p->cdcache_size;
+  }else if(lba<p->cdcache_begin){
     /* should always trigger a backseek so let's do that here and look for the timing */
     seekpos=(lba==0 || lba-1<cdda_disc_firstsector(p->d) ? lba : lba-1); /* keep reads linear when possible */
   }else{
@@ -2269,48 +2569,57 @@ static void cdrom_cache_handler(cdrom_paranoia *p, int lba, void(*callback)(long
     seekpos = (pre<cdda_disc_firstsector(p->d) ? post : pre);
   }
 
-  if(cdda_read_timed(p->d,NULL,seekpos,1,&ms)==1)
+  if(cdda_read_timed(p->d,NULL,seekpos,1,&ms)==1){
     if(seekpos<p->cdcache_begin && ms<MIN_SEEK_MS)
-      callback(seekpos*CD_FRAMEWORDS,PARANOIA_CB_CACHEERR);
+      read_callback(j,seekpos*CD_FRAMEWORDS,PARANOIA_CB_CACHEERR);
+    if(p->cdcache_adapt)cdrom_cache_adapt(p,seekpos,ms<MIN_SEEK_MS);
+  }
   cdrom_cache_update(p,seekpos,1);
   return;
 }
 
 
-/* ===========================================================================
- * read_c_block() (internal)
- *
- * This funtion reads many (p->readahead) sectors, encompassing at least
- * the requested words.
- *
- * It returns a c_block which encapsulates these sectors' data and sector
- * number.  The sectors come come from multiple low-level read requests.
- *
- * This function reads many sectors in order to exhaust any caching on the
- * drive itself, as caching would simply return the same incorrect data
- * over and over.  Paranoia depends on truly re-reading portions of the
- * disc to make sure the reads are accurate and correct any inaccuracies.
- *
- * Which precise sectors are read varies ("jiggles") between calls to
- * read_c_block, to prevent consistent errors across multiple reads
- * from being misinterpreted as correct data.
- *
- * The size of each low-level read is determined by the underlying driver
- * (p->d->nsectors), which allows the driver to specify how many sectors
- * can be read in a single request.  Historically, the Linux kernel could
- * only read 8 sectors at a time, with likely dropped samples between each
- * read request.  Other operating systems may have different limitations.
- *
- * This function is called by paranoia_read_limited(), which breaks the
- * c_block of read data into runs of samples that are likely to be
- * contiguous, verifies them and stores them in verified fragments, and
- * eventually merges the fragments into the verified root.
- *
- * This function returns the last c_block read or NULL on error.
- */
+/* Where a read for (beginword) wants to begin, before jiggling:
+   somewhat before the end of the root, or the cursor if the root
+   isn't of use. */
+static long i_read_target(cdrom_paranoia *p,long beginword){
+  root_block *root=&p->root;
+  long dynoverlap=(p->dynoverlap+CD_FRAMEWORDS-1)/CD_FRAMEWORDS; 
 
-c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
-		     void(*callback)(long,int)){
+  if(rv(root)==NULL || rb(root)>beginword)
+    return(p->cursor-dynoverlap); 
+  return(re(root)/(CD_FRAMEWORDS)-dynoverlap);
+}
+
+/* Where the read after (new) should begin if verifying (new) goes as
+   it usually does.  If another c_block also covers the end of the
+   root, the two should verify each other and the root reach as far
+   as both do.  If none does, (new) is the first look at what follows
+   and the next read goes over the same ground. */
+static long i_read_predict(cdrom_paranoia *p,long beginword,c_block *new){
+  root_block *root=&p->root;
+  long dynoverlap=(p->dynoverlap+CD_FRAMEWORDS-1)/CD_FRAMEWORDS; 
+  long edge,reach=-1;
+  c_block *c;
+
+  if(rv(root)==NULL || rb(root)>beginword)
+    edge=p->cursor*CD_FRAMEWORDS;
+  else
+    edge=re(root);
+
+  for(c=c_first(p);c;c=c_next(c))
+    if(c!=new && cb(c)<edge && ce(c)>edge)
+      reach=max(reach,min(ce(c),ce(new)));
+
+  if(reach>edge)return(reach/CD_FRAMEWORDS-dynoverlap);
+  return(i_read_target(p,beginword));
+}
+
+/* Lays out the next read in (j): where it begins (about (target), in
+   modes that overlap reads), how much it reads, and the storage it
+   reads into, making room for that first.  Only the caller's thread
+   does this.  Returns -1 if there's no memory for the read. */
+static int i_read_plan(cdrom_paranoia *p,long target,read_job *j){
 
 /* why do it this way?  We need to read lots of sectors to kludge
    around stupid read ahead buffers on cheap drives, as well as avoid
@@ -2318,18 +2627,10 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
    to try to break borderline drives more noticeably (and make broken
    drives with unaddressable sectors behave more often). */
       
-  long readat,firstread;
+  long readat;
   long totaltoread=p->cdcache_size;
   long sectatonce=p->d->nsectors;
   long driftcomp=(float)p->dyndrift/CD_FRAMEWORDS+.5;
-  c_block *new=NULL;
-  root_block *root=&p->root;
-  int16_t *buffer=NULL;
-  unsigned char *flags=NULL;
-  long sofar;
-  long dynoverlap=(p->dynoverlap+CD_FRAMEWORDS-1)/CD_FRAMEWORDS; 
-  long anyflag=0;
-
 
   /* Calculate the first sector to read.  This calculation takes
    * into account the need to jitter the starting point of the read
@@ -2342,12 +2643,6 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
   
   if(p->enable&(PARANOIA_MODE_VERIFY|PARANOIA_MODE_OVERLAP)){
     
-    long target;
-    if(rv(root)==NULL || rb(root)>beginword)
-      target=p->cursor-dynoverlap; 
-    else
-      target=re(root)/(CD_FRAMEWORDS)-dynoverlap;
-	
     /* we want to jitter the read alignment boundary, as some
        drives, beginning from a specific point, will tend to
        lose bytes between sectors in the same place.  Also, as
@@ -2365,26 +2660,75 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
   
   readat+=driftcomp;
   
-  /* Create a new, empty c_block and add it to the head of the
-   * list of c_blocks in memory.  It will be empty until the end of
-   * this subroutine.
+  /* Leave room in the list of c_blocks in memory for the one this
+   * read becomes.
    */
   if(p->enable&(PARANOIA_MODE_OVERLAP|PARANOIA_MODE_VERIFY)){
-    flags=calloc(totaltoread*CD_FRAMEWORDS,1);
-    new=new_c_block(p);
-    recover_cache(p);
+    while(p->cache->active>=p->cache_limit && c_last(p))
+      free_c_block(c_last(p));
   }else{
     /* in the case of root it's just the buffer */
     paranoia_resetall(p);	
-    new=new_c_block(p);
   }
 
-  buffer=malloc(totaltoread*CD_FRAMESIZE_RAW);
-  sofar=0;
-  firstread=-1;
+  /* With a memory limit set, size reads so that MEMORY_BLOCKS of
+   * them fit beside the sort index; verification wants several
+   * overlapping reads, and a couple of huge ones thrash.  Then make
+   * room for this read by retiring older c_blocks.  If that isn't
+   * enough even with every older c_block gone, read less (but at
+   * least one request's worth).
+   */
+  if(p->memory_limit>0){
+    long per=CD_FRAMESIZE_RAW;
+    long share=(p->memory_limit-sort_bytes(p->sortcache))/MEMORY_BLOCKS;
+    if(p->enable&(PARANOIA_MODE_OVERLAP|PARANOIA_MODE_VERIFY))
+      per+=(CD_FRAMEWORDS*FLAG_PLANES+7)/8;
+
+    totaltoread=min(totaltoread,max(share/per,sectatonce));
+    if(!recover_memory(p,totaltoread*per)){
+      long room=(p->memory_limit-i_paranoia_memory(p))/per;
+      totaltoread=max(room,min(sectatonce,totaltoread));
+    }
+  }
+
+  j->p=p;
+  j->readat=readat;
+  j->dyndrift=p->dyndrift;
+  j->totaltoread=totaltoread;
+  j->firstsector=p->current_firstsector;
+  j->lastsector=p->current_lastsector;
+
+  /* Retiring c_blocks above most likely left their storage in the
+   * pool for us to reuse.
+   */
+  j->flags=NULL;
+  j->buffer=c_buffer_get(p,totaltoread*CD_FRAMEWORDS,
+			 (p->enable&(PARANOIA_MODE_OVERLAP|PARANOIA_MODE_VERIFY))?
+			 &j->flags:NULL);
+  j->firstread=-1;
+  j->sofar=0;
+  j->anyflag=0;
+  j->lastflag=0;
+  j->nomedium=0;
+  j->nevents=0;
+  return(j->buffer?0:-1);
+}
+
+/* Does the reading (j) was laid out for.  This touches nothing of
+   p's but the drive and the drive cache model, so it can run on the
+   reader thread while the caller verifies. */
+static void i_read_span(void *arg){
+  read_job *j=arg;
+  cdrom_paranoia *p=j->p;
+  long readat=j->readat;
+  long totaltoread=j->totaltoread;
+  long sectatonce=p->d->nsectors;
+  int16_t *buffer=j->buffer;
+  flag_planes *flags=j->flags;
+  long sofar=0;
   
   /* we have a read span; flush the drive cache if needed */
-  cdrom_cache_handler(p, readat, callback);
+  cdrom_cache_handler(p, readat, j);
 
   /* Issue each of the low-level reads; the optimal read size is
    * approximately the cachemodel's cdrom cache size.  The only reason
@@ -2394,28 +2738,64 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
    * p->d->nsectors = number of sectors to read per request
    */
 
-  /* actual read loop */
-
-  while(sofar<totaltoread){
-    long secread=sectatonce;  /* number of sectors to read this request */
-    long adjread=readat;      /* first sector to read for this request */
-    long thisread;            /* how many sectors were read this request */
+  /* actual read loop
+   *
+   * Up to CDDA_QUEUE_DEPTH requests are kept queued with the driver,
+   * so that where it can, the drive goes on streaming the next ones
+   * while we take care of the one that's finished.  The requests are
+   * laid out in advance; none depends on how the one before it went.
+   */
 
-    /* don't under/overflow the audio session */
-    if(adjread<p->current_firstsector){
-      secread-=p->current_firstsector-adjread;
-      adjread=p->current_firstsector;
-    }
-    if(adjread+secread-1>p->current_lastsector)
-      secread=p->current_lastsector-adjread+1;
+  {
+    long qread[CDDA_QUEUE_DEPTH];  /* first sector of each queued request */
+    long qsize[CDDA_QUEUE_DEPTH];  /* and its length */
+    int  qhead=0,queued=0;
+    long issued=0;                 /* sectors requested so far */
+    int  more=1;
+
+    while(1){
+      long secread;            /* number of sectors to read this request */
+      long adjread;            /* first sector to read for this request */
+      long thisread;           /* how many sectors were read this request */
+
+      while(more && queued<CDDA_QUEUE_DEPTH && issued<totaltoread){
+	secread=sectatonce;
+	adjread=readat;
+
+	/* don't under/overflow the audio session */
+	if(adjread<j->firstsector){
+	  secread-=j->firstsector-adjread;
+	  adjread=j->firstsector;
+	}
+	if(adjread+secread-1>j->lastsector)
+	  secread=j->lastsector-adjread+1;
     
-    if(sofar+secread>totaltoread)secread=totaltoread-sofar;
+	if(issued+secread>totaltoread)secread=totaltoread-issued;
     
-    if(secread>0){
-      
-      if(firstread<0)firstread=adjread;
+	if(secread>0){
+	  int q=(qhead+queued)%CDDA_QUEUE_DEPTH;
+
+	  if(j->firstread<0)j->firstread=adjread;
+	  cdda_read_submit(p->d,buffer+issued*CD_FRAMEWORDS,adjread,secread);
+	  qread[q]=adjread;
+	  qsize[q]=secread;
+	  queued++;
+	  issued+=secread;
+	  readat=adjread+secread; 
+	}else /* secread <= 0 */
+	  if(readat<j->firstsector)
+	    readat+=sectatonce; /* due to being before the readable area */
+	  else
+	    more=0; /* due to being past the readable area */
+      }
+      if(!queued)break;
+
+      adjread=qread[qhead];
+      secread=qsize[qhead];
+      qhead=(qhead+1)%CDDA_QUEUE_DEPTH;
+      queued--;
 
-      /* Issue the low-level read to the driver.
+      /* Collect the low-level read from the driver.
        */
 
       /* If the low-level read returned too few sectors, pad the result
@@ -2435,16 +2815,14 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
        * you get substantially better performance. --Monty
        */
 
-      if((thisread=cdda_read(p->d,buffer+sofar*CD_FRAMEWORDS,adjread,
-			    secread))<secread){
+      if((thisread=cdda_read_reap(p->d,NULL))<secread){
 
 	if(thisread<0){
 	  if(errno==ENOMEDIUM){
 	    /* the one error we bail on immediately */
-	    if(new)free_c_block(new);
-	    if(buffer)free(buffer);
-	    if(flags)free(flags);
-	    return NULL;
+	    while(queued--)cdda_read_reap(p->d,NULL);
+	    j->nomedium=1;
+	    return;
 	  }
 	  thisread=0;
 	}
@@ -2452,13 +2830,13 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
 	/* Uhhh... right.  Make something up. But don't make us seek
            backward! */
 
-	if(callback)(*callback)((adjread+thisread)*CD_FRAMEWORDS,PARANOIA_CB_READERR);  
+	read_callback(j,(adjread+thisread)*CD_FRAMEWORDS,PARANOIA_CB_READERR);
 	memset(buffer+(sofar+thisread)*CD_FRAMEWORDS,0,
 	       CD_FRAMESIZE_RAW*(secread-thisread));
-	if(flags)memset(flags+(sofar+thisread)*CD_FRAMEWORDS,FLAGS_UNREAD,
-	       CD_FRAMEWORDS*(secread-thisread));
+	if(flags)flags_set(flags,(sofar+thisread)*CD_FRAMEWORDS,
+			   (sofar+secread)*CD_FRAMEWORDS,FLAGS_UNREAD);
       }
-      if(thisread!=0)anyflag=1;
+      if(thisread!=0)j->anyflag=1;
       
 
       /* Because samples are likely to be dropped between read requests,
@@ -2477,51 +2855,159 @@ c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
       if(flags && sofar!=0){
 	/* Don't verify across overlaps that are too close to one
            another */
-	int i=0;
-	for(i=-MIN_WORDS_OVERLAP/2;i<MIN_WORDS_OVERLAP/2;i++)
-	  flags[sofar*CD_FRAMEWORDS+i]|=FLAGS_EDGE;
+	flags_set(flags,sofar*CD_FRAMEWORDS-MIN_WORDS_OVERLAP/2,
+		  sofar*CD_FRAMEWORDS+MIN_WORDS_OVERLAP/2,FLAGS_EDGE);
       }
 
-      if(adjread+secread-1==p->current_lastsector)
-	new->lastsector=-1;
+      if(adjread+secread-1==j->lastsector)
+	j->lastflag=1;
       
-      if(callback)(*callback)((adjread+secread-1)*CD_FRAMEWORDS,PARANOIA_CB_READ);
+      read_callback(j,(adjread+secread-1)*CD_FRAMEWORDS,PARANOIA_CB_READ);
       
       cdrom_cache_update(p,adjread,secread);
       sofar+=secread;
-      readat=adjread+secread; 
-    }else /* secread <= 0 */
-      if(readat<p->current_firstsector)
-	readat+=sectatonce; /* due to being before the readable area */
-      else
-	break; /* due to being past the readable area */
-    
-    
-    /* Keep issuing read requests until we've read enough sectors to
-     * exhaust the drive's cache.
-     */
-    
-  } /* end while */
+      j->sofar=sofar;
+    }
+  }
+}
+
 
+/* Replays the callbacks (j)'s reads saved, then makes what was read
+   into a c_block, or returns NULL if nothing was. */
+static c_block *i_read_finish(cdrom_paranoia *p,read_job *j,
+			      void(*callback)(long,int)){
+  c_block *new=NULL;
+  int i;
+
+  if(callback)
+    for(i=0;i<j->nevents;i++)
+      (*callback)(j->events[i*2],j->events[i*2+1]);
+  j->nevents=0;
 
-  /* If we managed to read any sectors at all (anyflag), fill in the
-   * previously allocated c_block with the read data.  Otherwise, free
-   * our buffers, dispose of the c_block, and return NULL.
+  /* If we managed to read any sectors at all (anyflag), make a
+   * c_block of the read data and add it to the head of the list of
+   * c_blocks in memory.  Otherwise, free our buffers and return NULL.
    */
-  if(anyflag){
-    new->vector=buffer;
-    new->begin=firstread*CD_FRAMEWORDS-p->dyndrift;
-    new->size=sofar*CD_FRAMEWORDS;
-    new->flags=flags;
+  if(j->anyflag && !j->nomedium){
+    new=new_c_block(p);
+    new->vector=j->buffer;
+    new->alloc=j->totaltoread*CD_FRAMEWORDS;
+    new->begin=j->firstread*CD_FRAMEWORDS-j->dyndrift;
+    new->size=j->sofar*CD_FRAMEWORDS;
+    new->flags=j->flags;
+    if(j->lastflag)new->lastsector=-1;
   }else{
-    if(new)free_c_block(new);
-    free(buffer);
-    free(flags);
-    new=NULL;
+    c_buffer_put(p,j->buffer,j->totaltoread*CD_FRAMEWORDS,j->flags);
+    if(j->nomedium)errno=ENOMEDIUM;
   }
+  j->buffer=NULL;
+  j->flags=NULL;
   return(new);
 }
 
+/* Waits out a prefetch, if there is one, and throws it away. */
+void i_read_drain(cdrom_paranoia *p){
+  if(p->ahead_pending){
+    if(!p->ahead_done)task_wait(p->reader);
+    p->ahead_pending=0;
+    p->ahead.nevents=0;
+    p->ahead.anyflag=0;
+    i_read_finish(p,&p->ahead,NULL);
+  }
+}
+
+/* ===========================================================================
+ * read_c_block() (internal)
+ *
+ * This funtion reads many (p->readahead) sectors, encompassing at least
+ * the requested words.
+ *
+ * It returns a c_block which encapsulates these sectors' data and sector
+ * number.  The sectors come come from multiple low-level read requests.
+ *
+ * This function reads many sectors in order to exhaust any caching on the
+ * drive itself, as caching would simply return the same incorrect data
+ * over and over.  Paranoia depends on truly re-reading portions of the
+ * disc to make sure the reads are accurate and correct any inaccuracies.
+ *
+ * Which precise sectors are read varies ("jiggles") between calls to
+ * read_c_block, to prevent consistent errors across multiple reads
+ * from being misinterpreted as correct data.
+ *
+ * The size of each low-level read is determined by the underlying driver
+ * (p->d->nsectors), which allows the driver to specify how many sectors
+ * can be read in a single request.  Historically, the Linux kernel could
+ * only read 8 sectors at a time, with likely dropped samples between each
+ * read request.  Other operating systems may have different limitations.
+ *
+ * This function is called by paranoia_read_limited(), which breaks the
+ * c_block of read data into runs of samples that are likely to be
+ * contiguous, verifies them and stores them in verified fragments, and
+ * eventually merges the fragments into the verified root.
+ *
+ * This function returns the last c_block read or NULL on error, with
+ * errno ENOMEM if there was no memory to read into.
+ */
+
+c_block *i_read_c_block(cdrom_paranoia *p,long beginword,long endword,
+		     void(*callback)(long,int)){
+  c_block *new=NULL;
+
+  /* A prefetched read was laid out before the previous c_block was
+   * verified, on a guess as to where the root would get to.  If the
+   * root hasn't got that far, it's held on to until it does.  If it
+   * covers where a read would begin now (give or take the jiggle) and
+   * a good part of what follows, it's used.  Otherwise the root has
+   * moved past it and it goes.
+   */
+  if(p->ahead_pending){
+    read_job *j=&p->ahead;
+    long target=i_read_target(p,beginword);
+
+    if(!p->ahead_done){
+      task_wait(p->reader);
+      p->ahead_done=1;
+    }
+    if(j->readat<target+JIGGLE_MODULO){
+      p->ahead_pending=0;
+      if(j->readat+j->totaltoread>=target+j->totaltoread/2){
+	new=i_read_finish(p,j,callback);
+	if(!new && j->nomedium)return(NULL);
+      }else{
+	j->anyflag=0;
+	i_read_finish(p,j,callback);
+      }
+    }
+  }
+
+  if(!new){
+    read_job j;
+
+    memset(&j,0,sizeof(j));
+    if(i_read_plan(p,i_read_target(p,beginword),&j)){
+      errno=ENOMEM;
+      return(NULL);
+    }
+    j.callback=callback;
+    i_read_span(&j);
+    new=i_read_finish(p,&j,callback);
+    if(!new)return(NULL);
+  }
+
+  /* With a reader thread, start on the next read now; the caller
+   * verifies this one meanwhile.  Only overlapping/verifying modes
+   * keep more than one c_block to make this worthwhile.
+   */
+  if(p->reader && !p->ahead_pending &&
+     (p->enable&(PARANOIA_MODE_OVERLAP|PARANOIA_MODE_VERIFY)) &&
+     !i_read_plan(p,i_read_predict(p,beginword,new),&p->ahead)){
+    p->ahead.callback=NULL;
+    task_post(p->reader,i_read_span,&p->ahead);
+    p->ahead_pending=1;
+    p->ahead_done=0;
+  }
+  return(new);
+}
 
 /** ==========================================================================
  * paranoia_read(), paranoia_read_limited()
@@ -2537,11 +3023,36 @@ int16_t *paranoia_read(cdrom_paranoia *p, void(*callback)(long,int)){
   return paranoia_read_limited(p,callback,20);
 }
 
+static int16_t *i_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
+			       int max_retries);
+
+/* A prefetch may still be going when a read returns.  Its drive
+   errors and messages land in d->errorbuf/d->messagebuf when those
+   are being logged rather than printed, and the caller is free to
+   take and free them with cdda_errors()/cdda_messages() as soon as we
+   return; so in that case the reader has to be done with the drive
+   first.  The read it started is kept for the next call as usual. */
+static void i_read_release(cdrom_paranoia *p){
+  if(p->ahead_pending && !p->ahead_done &&
+     (p->d->errordest==CDDA_MESSAGE_LOGIT ||
+      p->d->messagedest==CDDA_MESSAGE_LOGIT)){
+    task_wait(p->reader);
+    p->ahead_done=1;
+  }
+}
+
   /* I added max_retry functionality this way in order to avoid
      breaking any old apps using the nerw libs.  cdparanoia 9.8 will
      need the updated libs, but nothing else will require it. */
 int16_t *paranoia_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
 			       int max_retries){
+  int16_t *ret=i_read_limited(p,callback,max_retries);
+  i_read_release(p);
+  return(ret);
+}
+
+static int16_t *i_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
+			       int max_retries){
 
   long beginword=p->cursor*(CD_FRAMEWORDS);
   long endword=beginword+CD_FRAMEWORDS;
@@ -2656,9 +3167,10 @@ int16_t *paranoia_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
 	    long begin=0,end=0;
 	    
 	    while(begin<cs(new)){
-	      while(begin<cs(new)&&(new->flags[begin]&FLAGS_EDGE))begin++;
+	      begin=flags_next(new->flags,begin,cs(new),FLAGS_EDGE,0);
 	      end=begin+1;
-	      while(end<cs(new)&&(new->flags[end]&FLAGS_EDGE)==0)end++;
+	      if(end<cs(new))
+		end=flags_next(new->flags,end,cs(new),FLAGS_EDGE,1);
 	      {
 		new_v_fragment(p,new,begin+cb(new),
 			       end+cb(new),
@@ -2686,8 +3198,8 @@ int16_t *paranoia_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
       }else{
 
 	/* Was the medium removed or the device closed out from
-	   under us? */
-	if(errno==ENOMEDIUM) return NULL;
+	   under us, or are we out of memory to read into? */
+	if(errno==ENOMEDIUM || errno==ENOMEM) return NULL;
       
       }
     }
@@ -2739,7 +3251,108 @@ int16_t *paranoia_read_limited(cdrom_paranoia *p, void(*callback)(long,int),
   return(rv(root)+(beginword-rb(root)));
 }
 
+/** ==========================================================================
+ * paranoia_read_span()
+ *
+ * Like paranoia_read_limited(), but returns as many contiguous
+ * sectors, up to (maxsectors), as the verified root can already
+ * supply, with the count in (*sectors).  Only the first sector may
+ * cost any reading or verification; the rest are the sectors that
+ * further paranoia_read_limited() calls would have handed back
+ * without doing any work, so the result is the same either way.
+ *
+ * The returned buffer belongs to paranoia and lasts until the next
+ * read call, as with paranoia_read().
+ */
+int16_t *paranoia_read_span(cdrom_paranoia *p, void(*callback)(long,int),
+			    int max_retries, long maxsectors, long *sectors){
+  root_block *root=&p->root;
+  int16_t *ret=paranoia_read_limited(p,callback,max_retries);
+  long margin=0,n=1;
+
+  *sectors=0;
+  if(!ret)return(NULL);
+
+  /* the margin paranoia_read_limited() insists on past each sector */
+  if(p->enable&(PARANOIA_MODE_VERIFY|PARANOIA_MODE_OVERLAP))
+    margin=MAX_SECTOR_OVERLAP*CD_FRAMEWORDS;
+
+  while(n<maxsectors &&
+	re(root)>=(p->cursor+1)*CD_FRAMEWORDS+margin){
+    /* as the call for this sector would have */
+    if(p->cursor*CD_FRAMEWORDS>p->root.returnedlimit)
+      p->root.returnedlimit=p->cursor*CD_FRAMEWORDS;
+    p->cursor++;
+    n++;
+  }
+
+  *sectors=n;
+  return(ret);
+}
+
 /* a temporary hack */
+void paranoia_threadset(cdrom_paranoia *p,int threads){
+  if(p->pool)pool_free(p->pool);
+  p->pool=NULL;
+
+  /* the calling thread is one of the (threads) */
+  if(threads>1)p->pool=pool_new(threads-1);
+}
+
+/* With (onoff) set, a reader thread reads the next c_block while the
+   calling thread verifies the last one.  The next read has to be laid
+   out before the last is verified, so now and then one turns out to
+   be in the wrong place and is thrown away; this pays off when
+   verification takes a good share of the time the drive does. */
+void paranoia_prefetchset(cdrom_paranoia *p,int onoff){
+  i_read_drain(p);
+  if(p->reader && !onoff){
+    task_free(p->reader);
+    p->reader=NULL;
+  }
+  if(!p->reader && onoff)
+    p->reader=task_new();
+}
+
+/* Sets the range the stage 1 probe stride adapts within; min==max
+   gives a fixed stride.  A max above MIN_WORDS_SEARCH may let short
+   matching runs slip between probes. */
+void paranoia_probeset(cdrom_paranoia *p,int min,int max){
+  if(min<1)min=1;
+  if(max<min)max=min;
+  p->probe_min=min;
+  p->probe_max=max;
+}
+
+/* Caps the memory this instance holds (see i_paranoia_memory()) at
+   (bytes); 0 removes the cap.  The cap can't usefully be less than the
+   root, the sort index and one read request need. */
+void paranoia_memoryset(cdrom_paranoia *p,long bytes){
+  p->memory_limit=(bytes>0?bytes:0);
+}
+
+long paranoia_memoryusage(cdrom_paranoia *p){
+  return(i_paranoia_memory(p));
+}
+
+void paranoia_bufferstats(cdrom_paranoia *p,long *current,long *peak){
+  if(current)*current=p->buffers.current;
+  if(peak)*peak=p->buffers.peak;
+}
+
+void paranoia_probestats(cdrom_paranoia *p,long *tried,long *matched){
+  if(tried)*tried=p->probes;
+  if(matched)*matched=p->probe_hits;
+}
+
+/* How often the sort index was emptied for a new c_block, and how
+   many of those times its generation stamps wrapped and had to be
+   cleared by hand. */
+void paranoia_sortstats(cdrom_paranoia *p,long *resets,long *wraps){
+  if(resets)*resets=p->sortcache->resets;
+  if(wraps)*wraps=p->sortcache->wraps;
+}
+
 void paranoia_overlapset(cdrom_paranoia *p, long overlap){
   p->dynoverlap=overlap*CD_FRAMEWORDS;
   p->stage1.offpoints=-1; 
@@ -0,0 +1,207 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ *
+ * Worker threads for the matching and read code
+ *
+ ***/
+
+/* Workers sleep on a condition variable between batches.  A batch is
+   a job function, its context and a job count; everyone, the caller
+   included, claims the next unclaimed job number under the lock until
+   none are left.  The last thread to finish a job wakes the caller.
+   Batches are small and few (one per c_block read), so a single lock
+   is plenty. */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+struct job_pool{
+  pthread_mutex_t lock;
+  pthread_cond_t  start;         /* a batch was posted, or we're quitting */
+  pthread_cond_t  done;          /* the last job of a batch finished */
+
+  pthread_t *threads;
+  int        nthreads;
+
+  /* current batch */
+  void     (*job)(void *ctx,long n);
+  void      *ctx;
+  long       jobs;
+  long       next;               /* next job number to hand out */
+  long       running;            /* jobs handed out but not finished */
+  long       batch;              /* bumped for every batch posted */
+  int        quit;
+};
+
+/* Runs jobs from the current batch until there are none left to claim.
+   Called with the lock held; returns with it held. */
+static void pool_drain(job_pool *pool){
+  while(pool->next<pool->jobs){
+    long n=pool->next++;
+    pool->running++;
+
+    pthread_mutex_unlock(&pool->lock);
+    pool->job(pool->ctx,n);
+    pthread_mutex_lock(&pool->lock);
+
+    pool->running--;
+    if(pool->next>=pool->jobs && pool->running==0)
+      pthread_cond_signal(&pool->done);
+  }
+}
+
+static void *pool_worker(void *arg){
+  job_pool *pool=arg;
+  long seen=0;
+
+  pthread_mutex_lock(&pool->lock);
+  while(1){
+    while(!pool->quit && pool->batch==seen)
+      pthread_cond_wait(&pool->start,&pool->lock);
+    if(pool->quit)break;
+    seen=pool->batch;
+    pool_drain(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return(NULL);
+}
+
+job_pool *pool_new(int threads){
+  job_pool *pool=calloc(1,sizeof(job_pool));
+
+  pthread_mutex_init(&pool->lock,NULL);
+  pthread_cond_init(&pool->start,NULL);
+  pthread_cond_init(&pool->done,NULL);
+  pool->threads=calloc(threads,sizeof(pthread_t));
+
+  for(;pool->nthreads<threads;pool->nthreads++)
+    if(pthread_create(pool->threads+pool->nthreads,NULL,pool_worker,pool))
+      break;
+
+  if(pool->nthreads==0){
+    pool_free(pool);
+    return(NULL);
+  }
+  return(pool);
+}
+
+void pool_run(job_pool *pool,void (*job)(void *ctx,long n),
+	      void *ctx,long jobs){
+  long n;
+
+  if(!pool){
+    for(n=0;n<jobs;n++)job(ctx,n);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->job=job;
+  pool->ctx=ctx;
+  pool->jobs=jobs;
+  pool->next=0;
+  pool->running=0;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->start);
+
+  pool_drain(pool);
+  while(pool->running)
+    pthread_cond_wait(&pool->done,&pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(job_pool *pool){
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit=1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(i=0;i<pool->nthreads;i++)
+    pthread_join(pool->threads[i],NULL);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+/**** background task ****************************************************/
+
+struct job_task{
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;          /* a job was posted or finished, or quit */
+  pthread_t       thread;
+
+  void          (*job)(void *ctx);
+  void           *ctx;
+  int             busy;          /* posted and not yet finished */
+  int             quit;
+};
+
+static void *task_worker(void *arg){
+  job_task *task=arg;
+
+  pthread_mutex_lock(&task->lock);
+  while(1){
+    while(!task->quit && !task->busy)
+      pthread_cond_wait(&task->cond,&task->lock);
+    if(task->quit)break;
+
+    pthread_mutex_unlock(&task->lock);
+    task->job(task->ctx);
+    pthread_mutex_lock(&task->lock);
+
+    task->busy=0;
+    pthread_cond_broadcast(&task->cond);
+  }
+  pthread_mutex_unlock(&task->lock);
+  return(NULL);
+}
+
+job_task *task_new(void){
+  job_task *task=calloc(1,sizeof(job_task));
+
+  pthread_mutex_init(&task->lock,NULL);
+  pthread_cond_init(&task->cond,NULL);
+  if(pthread_create(&task->thread,NULL,task_worker,task)){
+    pthread_cond_destroy(&task->cond);
+    pthread_mutex_destroy(&task->lock);
+    free(task);
+    return(NULL);
+  }
+  return(task);
+}
+
+void task_post(job_task *task,void (*job)(void *ctx),void *ctx){
+  pthread_mutex_lock(&task->lock);
+  task->job=job;
+  task->ctx=ctx;
+  task->busy=1;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+}
+
+void task_wait(job_task *task){
+  pthread_mutex_lock(&task->lock);
+  while(task->busy)
+    pthread_cond_wait(&task->cond,&task->lock);
+  pthread_mutex_unlock(&task->lock);
+}
+
+void task_free(job_task *task){
+  task_wait(task);
+
+  pthread_mutex_lock(&task->lock);
+  task->quit=1;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+
+  pthread_join(task->thread,NULL);
+  pthread_cond_destroy(&task->cond);
+  pthread_mutex_destroy(&task->lock);
+  free(task);
+}
@@ -0,0 +1,76 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ ***/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/* A small, fixed set of worker threads that run batches of numbered
+   jobs.  The caller works on the batch too, so a pool of n threads
+   keeps n+1 cores busy. */
+
+typedef struct job_pool job_pool;
+
+/*! ========================================================================
+ * pool_new()
+ *
+ * Starts (threads) workers.  Returns NULL if no thread could be
+ * started; pool_run() on a NULL pool simply runs the batch in the
+ * calling thread.
+ */
+extern job_pool *pool_new(int threads);
+
+/*! ========================================================================
+ * pool_run()
+ *
+ * Calls (job)(ctx,n) once for each n in [0,jobs), spread across the
+ * workers and the calling thread, and returns once every call has
+ * returned.  Which thread runs which job is unspecified; jobs must not
+ * depend on each other.
+ */
+extern void pool_run(job_pool *pool,void (*job)(void *ctx,long n),
+		     void *ctx,long jobs);
+
+/*! ========================================================================
+ * pool_free()
+ *
+ * Stops and joins the workers and releases the pool.
+ */
+extern void pool_free(job_pool *pool);
+
+/* A single background thread that runs one job at a time while the
+   caller gets on with something else. */
+
+typedef struct job_task job_task;
+
+/*! ========================================================================
+ * task_new()
+ *
+ * Starts the thread.  Returns NULL if it couldn't be started.
+ */
+extern job_task *task_new(void);
+
+/*! ========================================================================
+ * task_post()
+ *
+ * Has the thread call (job)(ctx) and returns at once.  Only one job may
+ * be outstanding; task_wait() for it before posting another.
+ */
+extern void task_post(job_task *task,void (*job)(void *ctx),void *ctx);
+
+/*! ========================================================================
+ * task_wait()
+ *
+ * Returns once the posted job, if any, has returned.
+ */
+extern void task_wait(job_task *task);
+
+/*! ========================================================================
+ * task_free()
+ *
+ * Waits for any posted job, then stops and joins the thread.
+ */
+extern void task_free(job_task *task);
+
+#endif
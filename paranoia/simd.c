@@ -0,0 +1,130 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ *
+ * Vectorized run extension kernels for the matching code
+ *
+ ***/
+
+/* Extending a candidate match one sample at a time is where stage 1
+   and stage 2 spend much of their time; every candidate found by the
+   sort index costs one of these scans in each direction.  The kernels
+   below compare 8 (SSE2) or 16 (AVX2) samples per step and locate
+   the first disagreement with a movemask and a bit scan.  The plain
+   C versions define the semantics and are used on everything else.
+   Flag checks are left to the callers (see flags.c). */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__) || __GNUC__>4 || (__GNUC__==4 && __GNUC_MINOR__>=9)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+#endif
+
+/**** plain C *************************************************************/
+
+static long match_f_c(int16_t *A,int16_t *B,long n){
+  long k;
+  for(k=0;k<n;k++)
+    if(A[k]!=B[k])break;
+  return(k);
+}
+
+static long match_r_c(int16_t *A,int16_t *B,long n){
+  long k;
+  for(k=0;k<n;k++)
+    if(A[-k]!=B[-k])break;
+  return(k);
+}
+
+#ifdef SIMD_X86
+
+/**** SSE2 ****************************************************************/
+
+__attribute__((target("sse2")))
+static long match_f_sse2(int16_t *A,int16_t *B,long n){
+  long k=0;
+  for(;k+8<=n;k+=8){
+    __m128i a=_mm_loadu_si128((__m128i *)(A+k));
+    __m128i b=_mm_loadu_si128((__m128i *)(B+k));
+    int m=_mm_movemask_epi8(_mm_cmpeq_epi16(a,b))^0xffff;
+    if(m)return(k+(__builtin_ctz(m)>>1));
+  }
+  return(k+match_f_c(A+k,B+k,n-k));
+}
+
+__attribute__((target("sse2")))
+static long match_r_sse2(int16_t *A,int16_t *B,long n){
+  long k=0;
+  for(;k+8<=n;k+=8){
+    /* lanes 0..7 hold samples -k-7..-k; the scan wants the highest
+       failing lane */
+    __m128i a=_mm_loadu_si128((__m128i *)(A-k-7));
+    __m128i b=_mm_loadu_si128((__m128i *)(B-k-7));
+    int m=_mm_movemask_epi8(_mm_cmpeq_epi16(a,b))^0xffff;
+    if(m)return(k+7-((31-__builtin_clz(m))>>1));
+  }
+  return(k+match_r_c(A-k,B-k,n-k));
+}
+
+/**** AVX2 ****************************************************************/
+
+__attribute__((target("avx2")))
+static long match_f_avx2(int16_t *A,int16_t *B,long n){
+  long k=0;
+  for(;k+16<=n;k+=16){
+    __m256i a=_mm256_loadu_si256((__m256i *)(A+k));
+    __m256i b=_mm256_loadu_si256((__m256i *)(B+k));
+    unsigned int m=~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(a,b));
+    if(m)return(k+(__builtin_ctz(m)>>1));
+  }
+  return(k+match_f_sse2(A+k,B+k,n-k));
+}
+
+__attribute__((target("avx2")))
+static long match_r_avx2(int16_t *A,int16_t *B,long n){
+  long k=0;
+  for(;k+16<=n;k+=16){
+    __m256i a=_mm256_loadu_si256((__m256i *)(A-k-15));
+    __m256i b=_mm256_loadu_si256((__m256i *)(B-k-15));
+    unsigned int m=~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(a,b));
+    if(m)return(k+15-((31-__builtin_clz(m))>>1));
+  }
+  return(k+match_r_sse2(A-k,B-k,n-k));
+}
+
+#endif
+
+/**** dispatch ************************************************************/
+
+/* The pointers start out aimed at the plain C kernels and are
+   resolved once, from paranoia_init(), before any worker thread of
+   the instance exists.  pthread_once() keeps instances set up in
+   different threads from writing them at the same time. */
+
+long (*i_match_f)(int16_t *A,int16_t *B,long n)=match_f_c;
+long (*i_match_r)(int16_t *A,int16_t *B,long n)=match_r_c;
+
+static pthread_once_t i_simd_once=PTHREAD_ONCE_INIT;
+
+static void i_simd_resolve(void){
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2")){
+    i_match_f=match_f_sse2;
+    i_match_r=match_r_sse2;
+  }
+  if(__builtin_cpu_supports("avx2")){
+    i_match_f=match_f_avx2;
+    i_match_r=match_r_avx2;
+  }
+#endif
+}
+
+void i_simd_init(void){
+  pthread_once(&i_simd_once,i_simd_resolve);
+}
@@ -0,0 +1,24 @@
+/***
+ * CopyPolicy: GNU Lesser General Public License 2.1 applies
+ * Copyright (C) by Monty (xiphmont@mit.edu)
+ ***/
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+/* Run extension kernels for the matching code.  Each is a pointer
+   that i_simd_init() aims at the widest implementation the running
+   CPU supports (AVX2, SSE2 or plain C). */
+
+/* Resolves the kernels; safe to call from any thread, any number of
+   times.  paranoia_init() calls it. */
+extern void i_simd_init(void);
+
+/* Returns the first k in [0,n) at which A[k]!=B[k], or n if the
+   first n samples agree. */
+extern long (*i_match_f)(int16_t *A,int16_t *B,long n);
+
+/* As i_match_f, but walks backward: compares A[-k] against B[-k]. */
+extern long (*i_match_r)(int16_t *A,int16_t *B,long n);
+
+#endif
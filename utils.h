@@ -4,8 +4,11 @@
 #include <errno.h>
 #include <string.h>
 
-extern long buffering_write(int outf, char *buffer, long num);
-extern int buffering_close(int fd);
+typedef struct buffered_writer buffered_writer;
+extern buffered_writer *buffering_open(int fd);
+extern long buffering_write(buffered_writer *w, char *buffer, long num);
+extern long buffering_write_swapped(buffered_writer *w, char *buffer, long num);
+extern int buffering_close(buffered_writer *w);
 
 /* I wonder how many alignment issues this is gonna trip in the
    future...  it shouldn't trip any...  I guess we'll find out :) */
@@ -29,6 +32,27 @@ static inline int16_t swap16(int16_t x){
 	 (((u_int16_t)x & 0xff00U) >>  8));
 }
 
+/* Copies (bytes) bytes from (src) to (dst), swapping the two bytes of
+   every 16 bit sample on the way; (dst) may be (src).  The bulk goes
+   eight bytes to a register, a form compilers also vectorize. */
+static inline void swap16_copy(void *dst,const void *src,long bytes){
+  unsigned char *d=dst;
+  const unsigned char *s=src;
+  long i=0;
+
+  for(;i+8<=bytes;i+=8){
+    u_int64_t x;
+    memcpy(&x,s+i,8);
+    x=((x>>8)&0x00ff00ff00ff00ffULL)|((x&0x00ff00ff00ff00ffULL)<<8);
+    memcpy(d+i,&x,8);
+  }
+  for(;i+1<bytes;i+=2){
+    unsigned char t=s[i];
+    d[i]=s[i+1];
+    d[i+1]=t;
+  }
+}
+
 #if BYTE_ORDER == LITTLE_ENDIAN
 
 static inline int32_t be32_to_cpu(int32_t x){